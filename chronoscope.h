@@ -9,119 +9,6361 @@
 #include <sstream>
 #include <fstream>
 #include <algorithm>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <cctype>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <set>
+#include <type_traits>
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+#if defined(__cpp_lib_source_location)
+#include <source_location>
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#if defined(_MSC_VER)
+#pragma comment(lib, "ws2_32.lib")
+#endif
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if !defined(_WIN32)
+#define CHRONOSCOPE_SYMBOLS
+#include <cstdlib>
+#include <cstring>
+#include <dlfcn.h>
+#include <cxxabi.h>
+#include <sys/stat.h>
+#if defined(__ELF__)
+#include <link.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+#if defined(__linux__) && !defined(CHRONOSCOPE_NO_SAMPLING)
+#define CHRONOSCOPE_SAMPLING
+#include <csignal>
+#include <cerrno>
+#include <ctime>
+#include <execinfo.h>
+#include <sys/syscall.h>
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CHRONOSCOPE_TSC
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#define PROFILER_ENABLED
+
+/// @brief What a profiler keeps per site
+enum class StatisticsMode
+{
+  /// @brief Call counts only, scopes never read the clock
+  CountOnly,
+  /// @brief Call counts and total, self and rollup durations
+  Sum,
+  /// @brief Sum plus a latency histogram per site
+  Histogram
+};
+
+/// @brief Where a profiler sends its scope events
+enum class TraceSink
+{
+  /// @brief Tracing compiled out, the timeline exports stay empty
+  None,
+  /// @brief Open and close events kept in a per-thread ring buffer for the timeline exports,
+  /// which overwrites the oldest events once full
+  Buffer,
+  /// @brief Buffer plus spans streamed to the OTLP exporter
+  Stream
+};
+
+/// @brief Monotonic clock read from the kernel's last tick (CLOCK_MONOTONIC_COARSE), a plain
+/// vDSO memory read without the TSC. Its resolution is the tick, typically 1 to 4 ms, so it
+/// suits frequent scopes that run for milliseconds. Falls back to steady_clock elsewhere
+struct CoarseClock
+{
+  using rep = long long;
+  using period = std::nano;
+  using duration = std::chrono::nanoseconds;
+  using time_point = std::chrono::time_point<CoarseClock>;
+  static constexpr bool is_steady = true;
+
+  static const char *name()
+  {
+    return "CLOCK_MONOTONIC_COARSE";
+  }
+
+  static time_point now() noexcept
+  {
+#if defined(CLOCK_MONOTONIC_COARSE)
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return time_point(duration(static_cast<long long>(ts.tv_sec) * 1000000000 + ts.tv_nsec));
+#else
+    return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()));
+#endif
+  }
+
+  static std::chrono::nanoseconds resolution()
+  {
+#if defined(CLOCK_MONOTONIC_COARSE)
+    timespec ts;
+    if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0)
+    {
+      return std::chrono::nanoseconds(static_cast<long long>(ts.tv_sec) * 1000000000 + ts.tv_nsec);
+    }
+#endif
+    return std::chrono::nanoseconds(1);
+  }
+};
+
+/// @brief Clock that only moves when told to, so tests get exact durations: a scope that calls
+/// ManualClock::advance(std::chrono::microseconds(5)) lasts exactly 5 us. The time is shared by
+/// all threads and starts at 0
+struct ManualClock
+{
+  using rep = long long;
+  using period = std::nano;
+  using duration = std::chrono::nanoseconds;
+  using time_point = std::chrono::time_point<ManualClock>;
+  static constexpr bool is_steady = true;
+
+  static const char *name()
+  {
+    return "manual";
+  }
+
+  static time_point now() noexcept
+  {
+    return time_point(duration(ticks().load(std::memory_order_acquire)));
+  }
+
+  /// @brief Moves the time forward by step
+  static void advance(std::chrono::nanoseconds step)
+  {
+    ticks().fetch_add(step.count(), std::memory_order_acq_rel);
+  }
+
+  /// @brief Sets the time, e.g. back to 0 between tests. Going backwards under running scopes
+  /// gives them negative durations
+  static void set(std::chrono::nanoseconds time)
+  {
+    ticks().store(time.count(), std::memory_order_release);
+  }
+
+  static std::chrono::nanoseconds resolution()
+  {
+    return std::chrono::nanoseconds(1);
+  }
+
+private:
+  static std::atomic<long long> &ticks()
+  {
+    static std::atomic<long long> time{0};
+    return time;
+  }
+};
+
+#if defined(CHRONOSCOPE_TSC)
+/// @brief Time stamp counter read with serializing fences, for microbenchmarks: now() runs
+/// "lfence; rdtsc" before the timed code and stop() "rdtscp; lfence" after it, so neither read
+/// drifts into the code. Ticks are converted to nanoseconds with a frequency measured against
+/// steady_clock for 10 ms on first use. Needs an invariant TSC
+struct TscClock
+{
+  using rep = long long;
+  using period = std::nano;
+  using duration = std::chrono::nanoseconds;
+  using time_point = std::chrono::time_point<TscClock>;
+  static constexpr bool is_steady = true;
+
+  static const char *name()
+  {
+    return "TSC (lfence; rdtsc)";
+  }
+
+  static time_point now() noexcept
+  {
+    const Calibration &scale = calibration();
+    _mm_lfence();
+    return fromTicks(__rdtsc(), scale);
+  }
+
+  static time_point stop() noexcept
+  {
+    const Calibration &scale = calibration();
+    unsigned int core = 0;
+    std::uint64_t ticks = __rdtscp(&core);
+    _mm_lfence();
+    return fromTicks(ticks, scale);
+  }
+
+  /// @brief TSC ticks per nanosecond
+  static double cyclesPerNs()
+  {
+    return calibration().ticksPerNs;
+  }
+
+private:
+  struct Calibration
+  {
+    std::uint64_t base;
+    double ticksPerNs;
+  };
+
+  static const Calibration &calibration()
+  {
+    static const Calibration scale = calibrate();
+    return scale;
+  }
+
+  static Calibration calibrate()
+  {
+    auto wallStart = std::chrono::steady_clock::now();
+    std::uint64_t start = __rdtsc();
+    while (std::chrono::steady_clock::now() - wallStart < std::chrono::milliseconds(10))
+    {
+    }
+    std::uint64_t end = __rdtsc();
+    auto wallEnd = std::chrono::steady_clock::now();
+    double elapsed = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(wallEnd - wallStart).count());
+    return Calibration{start, static_cast<double>(end - start) / elapsed};
+  }
+
+  static time_point fromTicks(std::uint64_t ticks, const Calibration &scale)
+  {
+    double elapsed = static_cast<double>(static_cast<std::int64_t>(ticks - scale.base));
+    return time_point(duration(static_cast<long long>(elapsed / scale.ticksPerNs)));
+  }
+};
+#endif
+
+/// @brief Compile-time configuration of a BasicProfiler. A specialized profiler derives from it and
+/// redefines the members to change, e.g. struct Counting : DefaultProfilerPolicy { static constexpr
+/// StatisticsMode kStatistics = StatisticsMode::CountOnly; }. The Profiler used by the macros takes
+/// this policy, shaped by CHRONOSCOPE_COUNT_ONLY, CHRONOSCOPE_HISTOGRAMS, CHRONOSCOPE_NO_TRACING
+/// and CHRONOSCOPE_COARSE_CLOCK
+struct DefaultProfilerPolicy
+{
+#if defined(CHRONOSCOPE_COARSE_CLOCK)
+  using Clock = CoarseClock;
+#else
+  using Clock = std::chrono::high_resolution_clock;
+#endif
+#if defined(CHRONOSCOPE_COUNT_ONLY)
+  static constexpr StatisticsMode kStatistics = StatisticsMode::CountOnly;
+#elif defined(CHRONOSCOPE_HISTOGRAMS)
+  static constexpr StatisticsMode kStatistics = StatisticsMode::Histogram;
+#else
+  static constexpr StatisticsMode kStatistics = StatisticsMode::Sum;
+#endif
+  /// @brief Ignored by count-only profilers, whose scopes have no timestamps to trace
+#if defined(CHRONOSCOPE_NO_TRACING)
+  static constexpr TraceSink kTraceSink = TraceSink::None;
+#else
+  static constexpr TraceSink kTraceSink = TraceSink::Stream;
+#endif
+  /// @brief Microbenchmark timing: a timer starts its clock after its bookkeeping, the shortest
+  /// empty measurement is subtracted from every scope, threads are pinned to their CPU and the
+  /// report adds cycles per call
+  static constexpr bool kBenchmark = false;
+};
+
+/// @brief Deterministic timing for tests, driven by ManualClock::advance
+struct ManualClockPolicy : DefaultProfilerPolicy
+{
+  using Clock = ManualClock;
+};
+
+#if defined(CHRONOSCOPE_TSC)
+/// @brief Serialized TSC timing for microbenchmarks, see DefaultProfilerPolicy::kBenchmark
+struct BenchmarkPolicy : DefaultProfilerPolicy
+{
+  using Clock = TscClock;
+  static constexpr TraceSink kTraceSink = TraceSink::None;
+  static constexpr bool kBenchmark = true;
+};
+#endif
+
+template <typename Policy>
+class BasicProfiler;
+template <typename ProfilerType>
+class BasicTimer;
+template <typename ProfilerType>
+class BasicLoopTimer;
+template <typename ProfilerType>
+class BasicScopedProfiler;
+
+using Profiler = BasicProfiler<DefaultProfilerPolicy>;
+using Timer = BasicTimer<Profiler>;
+using LoopTimer = BasicLoopTimer<Profiler>;
+using ScopedProfiler = BasicScopedProfiler<Profiler>;
+
+/// @brief Aggregated statistics of a site, durations are in nanoseconds
+struct ProfileInfo
+{
+  std::uint64_t count = 0;
+  /// @brief Inclusive time, a recursive call adds to it only at its outermost activation
+  long long duration = 0;
+  /// @brief Time not spent in nested instrumented scopes
+  long long selfDuration = 0;
+  /// @brief Calls made while another activation of the same site was open on the thread
+  unsigned int recursiveCount = 0;
+  /// @brief Deepest recursion seen, 1 for a site that never re-entered itself
+  unsigned int maxDepth = 0;
+  /// @brief Calls that ran longer than the budget of their RECORD_CALL_BUDGET() scope
+  unsigned int budgetViolations = 0;
+};
+
+/// @brief Log-linear histogram of nanosecond durations: every power of two is split into
+/// four buckets, so a recorded value is known to within 25%
+class LatencyHistogram
+{
+public:
+  static const std::uint32_t kBuckets = 252;
+
+  void record(std::uint64_t value)
+  {
+    counts[bucketOf(value)]++;
+    total++;
+    if (value > maximum)
+    {
+      maximum = value;
+    }
+  }
+
+  void merge(const LatencyHistogram &other)
+  {
+    for (std::uint32_t i = 0; i < kBuckets; ++i)
+    {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    if (other.maximum > maximum)
+    {
+      maximum = other.maximum;
+    }
+  }
+
+  std::uint64_t count() const
+  {
+    return total;
+  }
+
+  std::uint64_t max() const
+  {
+    return maximum;
+  }
+
+  /// @brief Upper bound of the bucket holding the given fraction (0..1) of the values
+  std::uint64_t percentile(double fraction) const
+  {
+    if (!total)
+    {
+      return 0;
+    }
+    std::uint64_t rank = static_cast<std::uint64_t>(fraction * static_cast<double>(total) + 0.5);
+    if (rank < 1)
+    {
+      rank = 1;
+    }
+    std::uint64_t seen = 0;
+    for (std::uint32_t i = 0; i < kBuckets; ++i)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+      {
+        std::uint64_t upper = i + 1 < kBuckets ? lowerBound(i + 1) - 1 : maximum;
+        return upper < maximum ? upper : maximum;
+      }
+    }
+    return maximum;
+  }
+
+private:
+  static std::uint32_t bucketOf(std::uint64_t value)
+  {
+    if (value < 4)
+    {
+      return static_cast<std::uint32_t>(value);
+    }
+    std::uint32_t msb = highestBit(value);
+    return 4 * (msb - 1) + static_cast<std::uint32_t>((value >> (msb - 2)) & 3);
+  }
+
+  static std::uint64_t lowerBound(std::uint32_t bucket)
+  {
+    if (bucket < 4)
+    {
+      return bucket;
+    }
+    std::uint32_t msb = bucket / 4 + 1;
+    return static_cast<std::uint64_t>(4 + bucket % 4) << (msb - 2);
+  }
+
+  static std::uint32_t highestBit(std::uint64_t value)
+  {
+#if defined(__GNUC__)
+    return 63 - static_cast<std::uint32_t>(__builtin_clzll(value));
+#else
+    std::uint32_t bit = 0;
+    for (std::uint32_t step = 32; step; step /= 2)
+    {
+      if (value >> (bit + step))
+      {
+        bit += step;
+      }
+    }
+    return bit;
+#endif
+  }
+
+  std::uint64_t counts[kBuckets] = {};
+  std::uint64_t total = 0;
+  std::uint64_t maximum = 0;
+};
+
+/// @brief Totals of one label value of a site
+struct LabelStats
+{
+  std::string label;
+  ProfileInfo info;
+  /// @brief False for heavy hitters and the overflow bucket
+  bool exact;
+  /// @brief Calls of a heavy hitter that may have happened before it got its slot
+  std::uint64_t error;
+  /// @brief Set for the bucket of the evicted labels' calls, whose label is empty
+  bool overflow;
+};
+
+/// @brief Per-label totals of a site. The first labels seen get exact slots, later ones compete
+/// for the slots of a space-saving sketch, and the calls of evicted labels fall into an overflow
+/// bucket, so the memory stays bounded whatever the number of distinct labels. Not synchronized
+class LabelTable
+{
+public:
+  static const std::uint32_t kOther = 0xffffffff;
+
+  LabelTable(std::size_t exactSlots, std::size_t sketchSlots) : exactSlots(exactSlots), sketchSlots(sketchSlots)
+  {
+  }
+
+  /// @brief Slot of the label, counting the call. The generation tells record() whether the
+  /// slot still belongs to the label when the call ends
+  std::uint32_t slot(const std::string &label, std::uint32_t &generation)
+  {
+    auto it = index.find(label);
+    std::uint32_t slot = 0;
+    if (it != index.end())
+    {
+      slot = it->second;
+    }
+    else if (entries.size() < exactSlots + sketchSlots)
+    {
+      slot = static_cast<std::uint32_t>(entries.size());
+      entries.push_back(Entry{label, ProfileInfo(), 0, 0, 0, entries.size() < exactSlots});
+      index.emplace(label, slot);
+    }
+    else if (!sketchSlots)
+    {
+      return kOther;
+    }
+    else
+    {
+      // The label takes over the slot of the least frequent heavy hitter, inheriting its count
+      // as the error bound
+      slot = static_cast<std::uint32_t>(exactSlots);
+      for (std::size_t i = exactSlots + 1; i < entries.size(); ++i)
+      {
+        if (entries[i].hits < entries[slot].hits)
+        {
+          slot = static_cast<std::uint32_t>(i);
+        }
+      }
+      Entry &evicted = entries[slot];
+      addTo(other, evicted.info);
+      index.erase(evicted.label);
+      evicted.label = label;
+      evicted.info = ProfileInfo();
+      evicted.error = evicted.hits;
+      evicted.generation++;
+      index.emplace(label, slot);
+    }
+    entries[slot].hits++;
+    generation = entries[slot].generation;
+    return slot;
+  }
+
+  /// @brief The label of an exact slot, which keeps its slot and its storage for good, or nullptr
+  const std::string *exactLabel(std::uint32_t slot) const
+  {
+    return slot != kOther && entries[slot].exact ? &entries[slot].label : nullptr;
+  }
+
+  void record(std::uint32_t slot, std::uint32_t generation, long long duration, long long self)
+  {
+    ProfileInfo &info = slot != kOther && entries[slot].generation == generation ? entries[slot].info : other;
+    info.count++;
+    info.duration += duration;
+    info.selfDuration += self;
+  }
+
+  /// @brief Zeroes the counts. The labels keep their slots, which threads cache and open scopes hold
+  void clear()
+  {
+    for (Entry &entry : entries)
+    {
+      entry.info = ProfileInfo();
+      entry.hits = 0;
+      entry.error = 0;
+    }
+    other = ProfileInfo();
+  }
+
+  /// @brief The labels heaviest first, then the overflow bucket if it has calls
+  std::vector<LabelStats> stats() const
+  {
+    std::vector<LabelStats> result;
+    for (const Entry &entry : entries)
+    {
+      if (entry.info.count)
+      {
+        result.push_back(LabelStats{entry.label, entry.info, entry.exact, entry.error, false});
+      }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const LabelStats &a, const LabelStats &b) { return a.info.duration > b.info.duration; });
+    if (other.count)
+    {
+      result.push_back(LabelStats{std::string(), other, false, 0, true});
+    }
+    return result;
+  }
+
+private:
+  struct Entry
+  {
+    std::string label;
+    ProfileInfo info;
+    std::uint64_t hits;
+    std::uint64_t error;
+    std::uint32_t generation;
+    bool exact;
+  };
+
+  static void addTo(ProfileInfo &total, const ProfileInfo &info)
+  {
+    total.count += info.count;
+    total.duration += info.duration;
+    total.selfDuration += info.selfDuration;
+  }
+
+  std::size_t exactSlots;
+  std::size_t sketchSlots;
+  /// @brief A deque so the labels of exact slots never move
+  std::deque<Entry> entries;
+  std::unordered_map<std::string, std::uint32_t> index;
+  ProfileInfo other;
+};
+
+/// @brief lock_guard that also marks the thread as running profiler code, so the
+/// -finstrument-functions hooks ignore library functions called under profiler locks
+class ProfilerLock
+{
+public:
+  explicit ProfilerLock(std::mutex &mutex) : mtx(mutex)
+  {
+    ++busyDepth();
+    mtx.lock();
+  }
+
+  ~ProfilerLock()
+  {
+    mtx.unlock();
+    --busyDepth();
+  }
+
+  ProfilerLock(ProfilerLock const &) = delete;
+  void operator=(ProfilerLock const &) = delete;
+
+  static int &busyDepth()
+  {
+    static thread_local int depth = 0;
+    return depth;
+  }
+
+private:
+  std::mutex &mtx;
+};
+
+/// @brief Marks the end of the profiler singletons. Static destructors run instrumented code too,
+/// so the -finstrument-functions hooks stop once the process starts destroying them. The flag
+/// has no destructor and stays readable until the process ends
+struct ProfilerShutdown
+{
+  static std::atomic<bool> &started()
+  {
+    static std::atomic<bool> flag{false};
+    return flag;
+  }
+
+  static void begin()
+  {
+    started().store(true, std::memory_order_relaxed);
+  }
+
+  /// @brief Called right after a singleton is constructed, so begin() runs before its destructor
+  static void registerSingleton()
+  {
+    std::atexit(&ProfilerShutdown::begin);
+  }
+};
+
+#if defined(CHRONOSCOPE_SYMBOLS)
+/// @brief Function and source location of a code address
+struct SymbolInfo
+{
+  std::string function;
+  std::string module;
+  std::string file;
+  int line = 0;
+};
+
+/// @brief Resolves code addresses to demangled functions and source lines. Loaded modules are parsed on
+/// first use, ELF symbol tables and DWARF line tables where present, with dladdr as the fallback. Results
+/// are kept in a sharded cache; this is report-time machinery and never runs on the recording path
+class Symbolizer
+{
+public:
+  static Symbolizer &getInstance()
+  {
+    static Symbolizer instance;
+    static const bool registered = (ProfilerShutdown::registerSingleton(), true);
+    (void)registered;
+    return instance;
+  }
+
+  const SymbolInfo &resolve(void *address)
+  {
+    Shard &shard = shards[(reinterpret_cast<std::uintptr_t>(address) >> 4) % kShards];
+    {
+      ProfilerLock lock(shard.mtx);
+      auto it = shard.cache.find(address);
+      if (it != shard.cache.end())
+      {
+        return it->second;
+      }
+    }
+
+    SymbolInfo info = lookup(reinterpret_cast<std::uintptr_t>(address));
+    ProfilerLock lock(shard.mtx);
+    return shard.cache.emplace(address, std::move(info)).first->second;
+  }
+
+  static std::string demangle(const char *symbol)
+  {
+    int status = 0;
+    char *demangled = abi::__cxa_demangle(symbol, nullptr, nullptr, &status);
+    std::string result(status == 0 && demangled ? demangled : symbol);
+    std::free(demangled);
+    return result;
+  }
+
+private:
+  Symbolizer() {}
+  Symbolizer(Symbolizer const &) = delete;
+  void operator=(Symbolizer const &) = delete;
+
+  static const std::size_t kShards = 16;
+
+  struct Shard
+  {
+    std::mutex mtx;
+    std::unordered_map<void *, SymbolInfo> cache;
+  };
+
+  struct Symbol
+  {
+    std::uintptr_t start;
+    std::uintptr_t size;
+    const char *name;
+  };
+
+  struct LineRow
+  {
+    std::uintptr_t address;
+    std::uint32_t file;
+    std::uint32_t line;
+    bool endSequence;
+  };
+
+  /// @brief A loaded object, addresses in its tables are relative to base
+  struct Module
+  {
+    std::string path;
+    std::uintptr_t base = 0;
+    std::vector<std::pair<std::uintptr_t, std::uintptr_t>> ranges;
+    bool loaded = false;
+#if defined(__ELF__)
+    void *image = nullptr;
+    std::size_t imageSize = 0;
+#endif
+    std::vector<Symbol> symbols;
+    std::vector<std::string> files;
+    std::vector<LineRow> lines;
+
+    ~Module()
+    {
+#if defined(__ELF__)
+      if (image)
+      {
+        munmap(image, imageSize);
+      }
+#endif
+    }
+  };
+
+  SymbolInfo lookup(std::uintptr_t address)
+  {
+    SymbolInfo info;
+    {
+      ProfilerLock lock(modulesMtx);
+      Module *module = findModule(address);
+      if (module)
+      {
+        if (!module->loaded)
+        {
+          load(*module);
+        }
+        std::uintptr_t offset = address - module->base;
+        info.module = module->path.substr(module->path.find_last_of('/') + 1);
+
+        auto symbol = std::upper_bound(module->symbols.begin(), module->symbols.end(), offset,
+                                       [](std::uintptr_t value, const Symbol &entry) { return value < entry.start; });
+        if (symbol != module->symbols.begin() && offset < (symbol - 1)->start + (symbol - 1)->size)
+        {
+          info.function = demangle((symbol - 1)->name);
+        }
+
+        auto row = std::upper_bound(module->lines.begin(), module->lines.end(), offset,
+                                    [](std::uintptr_t value, const LineRow &entry) { return value < entry.address; });
+        if (row != module->lines.begin() && !(row - 1)->endSequence && (row - 1)->file < module->files.size())
+        {
+          info.file = module->files[(row - 1)->file];
+          info.line = static_cast<int>((row - 1)->line);
+        }
+      }
+    }
+
+    Dl_info dlInfo;
+    if (info.function.empty() && dladdr(reinterpret_cast<void *>(address), &dlInfo))
+    {
+      if (dlInfo.dli_sname)
+      {
+        info.function = demangle(dlInfo.dli_sname);
+      }
+      else if (dlInfo.dli_fname)
+      {
+        std::string module(dlInfo.dli_fname);
+        std::stringstream ss;
+        ss << module.substr(module.find_last_of('/') + 1) << "+0x" << std::hex
+           << (address - reinterpret_cast<std::uintptr_t>(dlInfo.dli_fbase));
+        info.function = ss.str();
+      }
+    }
+    if (info.function.empty())
+    {
+      std::stringstream ss;
+      ss << "0x" << std::hex << address;
+      info.function = ss.str();
+    }
+    return info;
+  }
+
+  /// @brief Expects modulesMtx to be held. The module list is refreshed when an address
+  /// falls outside every known module, e.g. after a dlopen
+  Module *findModule(std::uintptr_t address)
+  {
+    for (int attempt = 0; attempt < 2; ++attempt)
+    {
+      for (const auto &module : modules)
+      {
+        for (const auto &range : module->ranges)
+        {
+          if (address >= range.first && address < range.second)
+          {
+            return module.get();
+          }
+        }
+      }
+      if (attempt == 0)
+      {
+        listModules();
+      }
+    }
+    return nullptr;
+  }
+
+#if defined(__ELF__)
+  void listModules()
+  {
+    dl_iterate_phdr(
+        [](dl_phdr_info *phdr, std::size_t, void *data) -> int
+        {
+          Symbolizer &self = *static_cast<Symbolizer *>(data);
+          std::string path = phdr->dlpi_name && phdr->dlpi_name[0] ? phdr->dlpi_name : "";
+          if (path.empty())
+          {
+            char executable[4096];
+            ssize_t length = readlink("/proc/self/exe", executable, sizeof(executable) - 1);
+            path = length > 0 ? std::string(executable, static_cast<std::size_t>(length)) : "/proc/self/exe";
+          }
+          for (const auto &module : self.modules)
+          {
+            if (module->base == phdr->dlpi_addr && module->path == path)
+            {
+              return 0;
+            }
+          }
+
+          std::unique_ptr<Module> module(new Module());
+          module->path = path;
+          module->base = phdr->dlpi_addr;
+          for (int i = 0; i < phdr->dlpi_phnum; ++i)
+          {
+            if (phdr->dlpi_phdr[i].p_type == PT_LOAD)
+            {
+              std::uintptr_t start = phdr->dlpi_addr + phdr->dlpi_phdr[i].p_vaddr;
+              module->ranges.emplace_back(start, start + phdr->dlpi_phdr[i].p_memsz);
+            }
+          }
+          self.modules.push_back(std::move(module));
+          return 0;
+        },
+        this);
+  }
+
+  /// @brief Maps the module's file and reads its function symbols and line table
+  static void load(Module &module)
+  {
+    module.loaded = true;
+    int fd = ::open(module.path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(ElfW(Ehdr)))
+    {
+      ::close(fd);
+      return;
+    }
+    void *image = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (image == MAP_FAILED)
+    {
+      return;
+    }
+    module.image = image;
+    module.imageSize = static_cast<std::size_t>(st.st_size);
+
+    const unsigned char *data = static_cast<const unsigned char *>(image);
+    const ElfW(Ehdr) *header = static_cast<const ElfW(Ehdr) *>(image);
+    if (std::memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 || header->e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32) ||
+        header->e_shoff + static_cast<std::size_t>(header->e_shnum) * sizeof(ElfW(Shdr)) > module.imageSize)
+    {
+      return;
+    }
+
+    const ElfW(Shdr) *sections = reinterpret_cast<const ElfW(Shdr) *>(data + header->e_shoff);
+    auto sectionData = [&](const ElfW(Shdr) &section, std::size_t &size) -> const unsigned char *
+    {
+      if (section.sh_type == SHT_NOBITS || (section.sh_flags & SHF_COMPRESSED) || section.sh_offset + section.sh_size > module.imageSize)
+      {
+        size = 0;
+        return nullptr;
+      }
+      size = section.sh_size;
+      return data + section.sh_offset;
+    };
+    const char *sectionNames = nullptr;
+    std::size_t sectionNamesSize = 0;
+    if (header->e_shstrndx < header->e_shnum)
+    {
+      sectionNames = reinterpret_cast<const char *>(sectionData(sections[header->e_shstrndx], sectionNamesSize));
+    }
+
+    // .symtab is a superset of .dynsym, the latter is only used for stripped modules
+    const ElfW(Shdr) *symbolTable = nullptr;
+    const unsigned char *debugLine = nullptr;
+    const unsigned char *debugLineStr = nullptr;
+    const unsigned char *debugStr = nullptr;
+    std::size_t debugLineSize = 0, debugLineStrSize = 0, debugStrSize = 0;
+    for (int i = 0; i < header->e_shnum; ++i)
+    {
+      const ElfW(Shdr) &section = sections[i];
+      if (section.sh_type == SHT_SYMTAB || (section.sh_type == SHT_DYNSYM && !symbolTable))
+      {
+        symbolTable = &section;
+      }
+      if (!sectionNames || section.sh_name >= sectionNamesSize)
+      {
+        continue;
+      }
+      std::string name(sectionNames + section.sh_name);
+      if (name == ".debug_line")
+        debugLine = sectionData(section, debugLineSize);
+      else if (name == ".debug_line_str")
+        debugLineStr = sectionData(section, debugLineStrSize);
+      else if (name == ".debug_str")
+        debugStr = sectionData(section, debugStrSize);
+    }
+
+    if (symbolTable && symbolTable->sh_link < header->e_shnum)
+    {
+      std::size_t symbolsSize = 0;
+      std::size_t stringsSize = 0;
+      const ElfW(Sym) *symbols = reinterpret_cast<const ElfW(Sym) *>(sectionData(*symbolTable, symbolsSize));
+      const char *strings = reinterpret_cast<const char *>(sectionData(sections[symbolTable->sh_link], stringsSize));
+      for (std::size_t i = 0; symbols && strings && i < symbolsSize / sizeof(ElfW(Sym)); ++i)
+      {
+        const ElfW(Sym) &symbol = symbols[i];
+        unsigned char type = ELF64_ST_TYPE(symbol.st_info);
+        if ((type == STT_FUNC || type == STT_GNU_IFUNC) && symbol.st_shndx != SHN_UNDEF && symbol.st_size &&
+            symbol.st_name < stringsSize)
+        {
+          module.symbols.push_back(Symbol{symbol.st_value, symbol.st_size, strings + symbol.st_name});
+        }
+      }
+      std::sort(module.symbols.begin(), module.symbols.end(),
+                [](const Symbol &a, const Symbol &b) { return a.start < b.start; });
+    }
+
+    if (debugLine)
+    {
+      DwarfStrings strings{debugLineStr, debugLineStrSize, debugStr, debugStrSize};
+      parseDebugLine(module, debugLine, debugLineSize, strings);
+      std::stable_sort(module.lines.begin(), module.lines.end(),
+                       [](const LineRow &a, const LineRow &b) { return a.address < b.address; });
+    }
+  }
+
+  /// @brief Bounds-checked little-endian reader over a DWARF section
+  struct ByteReader
+  {
+    const unsigned char *pos;
+    const unsigned char *end;
+    bool ok = true;
+
+    ByteReader(const unsigned char *begin, const unsigned char *limit) : pos(begin), end(limit) {}
+
+    std::uint64_t fixed(std::size_t bytes)
+    {
+      if (static_cast<std::size_t>(end - pos) < bytes)
+      {
+        ok = false;
+        pos = end;
+        return 0;
+      }
+      std::uint64_t value = 0;
+      for (std::size_t i = 0; i < bytes; ++i)
+      {
+        value |= static_cast<std::uint64_t>(pos[i]) << (8 * i);
+      }
+      pos += bytes;
+      return value;
+    }
+
+    std::uint64_t uleb()
+    {
+      std::uint64_t value = 0;
+      for (int shift = 0; pos < end; shift += 7)
+      {
+        unsigned char byte = *pos++;
+        if (shift < 64)
+          value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+          return value;
+      }
+      ok = false;
+      return value;
+    }
+
+    std::int64_t sleb()
+    {
+      std::int64_t value = 0;
+      int shift = 0;
+      while (pos < end)
+      {
+        unsigned char byte = *pos++;
+        if (shift < 64)
+          value |= static_cast<std::int64_t>(byte & 0x7f) << shift;
+        shift += 7;
+        if (!(byte & 0x80))
+        {
+          if (shift < 64 && (byte & 0x40))
+            value |= -(static_cast<std::int64_t>(1) << shift);
+          return value;
+        }
+      }
+      ok = false;
+      return value;
+    }
+
+    const char *string()
+    {
+      const unsigned char *start = pos;
+      while (pos < end && *pos)
+      {
+        ++pos;
+      }
+      if (pos == end)
+      {
+        ok = false;
+        return "";
+      }
+      ++pos;
+      return reinterpret_cast<const char *>(start);
+    }
+  };
+
+  struct DwarfStrings
+  {
+    const unsigned char *lineStr;
+    std::size_t lineStrSize;
+    const unsigned char *str;
+    std::size_t strSize;
+  };
+
+  /// @brief Reads one attribute of a DWARF 5 directory or file entry, returns it as a string for path
+  /// forms and through number for the numeric ones. Returns false on forms it cannot skip
+  static bool readEntryForm(ByteReader &reader, std::uint64_t form, bool dwarf64, const DwarfStrings &strings,
+                            std::string &text, std::uint64_t &number)
+  {
+    switch (form)
+    {
+    case 0x08: // DW_FORM_string
+      text = reader.string();
+      return reader.ok;
+    case 0x1f: // DW_FORM_line_strp
+    case 0x0e: // DW_FORM_strp
+    {
+      std::uint64_t offset = reader.fixed(dwarf64 ? 8 : 4);
+      const unsigned char *base = form == 0x1f ? strings.lineStr : strings.str;
+      std::size_t size = form == 0x1f ? strings.lineStrSize : strings.strSize;
+      text = base && offset < size ? std::string(reinterpret_cast<const char *>(base + offset)) : std::string();
+      return reader.ok;
+    }
+    case 0x0b: // DW_FORM_data1
+      number = reader.fixed(1);
+      return reader.ok;
+    case 0x05: // DW_FORM_data2
+      number = reader.fixed(2);
+      return reader.ok;
+    case 0x06: // DW_FORM_data4
+      number = reader.fixed(4);
+      return reader.ok;
+    case 0x07: // DW_FORM_data8
+      number = reader.fixed(8);
+      return reader.ok;
+    case 0x1e: // DW_FORM_data16
+      reader.fixed(8);
+      reader.fixed(8);
+      return reader.ok;
+    case 0x0f: // DW_FORM_udata
+      number = reader.uleb();
+      return reader.ok;
+    case 0x09: // DW_FORM_block
+    {
+      std::uint64_t length = reader.uleb();
+      if (length > static_cast<std::uint64_t>(reader.end - reader.pos))
+        return false;
+      reader.pos += length;
+      return reader.ok;
+    }
+    default:
+      return false;
+    }
+  }
+
+  /// @brief Runs the line number programs of all compilation units (DWARF 2 to 5) into module.lines
+  static void parseDebugLine(Module &module, const unsigned char *section, std::size_t size, const DwarfStrings &strings)
+  {
+    std::unordered_map<std::string, std::uint32_t> fileIndex;
+    auto internFile = [&](const std::string &path) -> std::uint32_t
+    {
+      auto it = fileIndex.find(path);
+      if (it != fileIndex.end())
+      {
+        return it->second;
+      }
+      std::uint32_t index = static_cast<std::uint32_t>(module.files.size());
+      module.files.push_back(path);
+      fileIndex.emplace(path, index);
+      return index;
+    };
+    auto joinPath = [](const std::string &directory, const std::string &file)
+    { return file.empty() || file[0] == '/' || directory.empty() ? file : directory + "/" + file; };
+
+    ByteReader unitReader(section, section + size);
+    while (unitReader.ok && unitReader.pos < unitReader.end)
+    {
+      std::uint64_t unitLength = unitReader.fixed(4);
+      bool dwarf64 = unitLength == 0xffffffff;
+      if (dwarf64)
+      {
+        unitLength = unitReader.fixed(8);
+      }
+      if (!unitReader.ok || unitLength > static_cast<std::uint64_t>(unitReader.end - unitReader.pos))
+      {
+        return;
+      }
+      const unsigned char *unitEnd = unitReader.pos + unitLength;
+      ByteReader reader(unitReader.pos, unitEnd);
+      unitReader.pos = unitEnd;
+
+      std::uint16_t version = static_cast<std::uint16_t>(reader.fixed(2));
+      if (version < 2 || version > 5)
+      {
+        continue;
+      }
+      if (version >= 5)
+      {
+        reader.fixed(1); // address_size
+        reader.fixed(1); // segment_selector_size
+      }
+      std::uint64_t headerLength = reader.fixed(dwarf64 ? 8 : 4);
+      if (!reader.ok || headerLength > static_cast<std::uint64_t>(reader.end - reader.pos))
+      {
+        continue;
+      }
+      const unsigned char *program = reader.pos + headerLength;
+      std::uint8_t minInstructionLength = static_cast<std::uint8_t>(reader.fixed(1));
+      if (version >= 4)
+      {
+        reader.fixed(1); // maximum_operations_per_instruction
+      }
+      reader.fixed(1); // default_is_stmt
+      std::int8_t lineBase = static_cast<std::int8_t>(reader.fixed(1));
+      std::uint8_t lineRange = static_cast<std::uint8_t>(reader.fixed(1));
+      std::uint8_t opcodeBase = static_cast<std::uint8_t>(reader.fixed(1));
+      std::vector<std::uint8_t> opcodeLengths(opcodeBase ? opcodeBase - 1 : 0);
+      for (auto &length : opcodeLengths)
+      {
+        length = static_cast<std::uint8_t>(reader.fixed(1));
+      }
+      if (!reader.ok || !lineRange)
+      {
+        continue;
+      }
+
+      std::vector<std::string> directories;
+      std::vector<std::uint32_t> files;
+      if (version >= 5)
+      {
+        bool valid = true;
+        for (int table = 0; table < 2 && valid; ++table)
+        {
+          std::uint8_t formatCount = static_cast<std::uint8_t>(reader.fixed(1));
+          std::vector<std::pair<std::uint64_t, std::uint64_t>> formats;
+          for (std::uint8_t i = 0; i < formatCount; ++i)
+          {
+            std::uint64_t contentType = reader.uleb();
+            formats.emplace_back(contentType, reader.uleb());
+          }
+          std::uint64_t count = reader.uleb();
+          for (std::uint64_t entry = 0; entry < count && valid && reader.ok; ++entry)
+          {
+            std::string path;
+            std::uint64_t directory = 0;
+            for (const auto &format : formats)
+            {
+              std::string text;
+              std::uint64_t number = 0;
+              valid = valid && readEntryForm(reader, format.second, dwarf64, strings, text, number);
+              if (format.first == 1) // DW_LNCT_path
+                path = text;
+              else if (format.first == 2) // DW_LNCT_directory_index
+                directory = number;
+            }
+            if (table == 0)
+              directories.push_back(path);
+            else
+              files.push_back(internFile(joinPath(directory < directories.size() ? directories[directory] : "", path)));
+          }
+        }
+        if (!valid || !reader.ok)
+        {
+          continue;
+        }
+      }
+      else
+      {
+        // Directory 0 and file 0 are implicit before DWARF 5, indices start at 1
+        directories.push_back("");
+        for (const char *directory = reader.string(); reader.ok && *directory; directory = reader.string())
+        {
+          directories.push_back(directory);
+        }
+        files.push_back(internFile(""));
+        for (const char *file = reader.string(); reader.ok && *file; file = reader.string())
+        {
+          std::uint64_t directory = reader.uleb();
+          reader.uleb(); // modification time
+          reader.uleb(); // length
+          files.push_back(internFile(joinPath(directory < directories.size() ? directories[directory] : "", file)));
+        }
+      }
+
+      reader.pos = program;
+      std::uintptr_t address = 0;
+      std::uint64_t file = 1;
+      std::int64_t line = 1;
+      auto emit = [&](bool endSequence)
+      {
+        std::uint32_t fileId = file < files.size() ? files[file] : static_cast<std::uint32_t>(module.files.size());
+        module.lines.push_back(LineRow{address, fileId, static_cast<std::uint32_t>(line), endSequence});
+      };
+      while (reader.ok && reader.pos < reader.end)
+      {
+        std::uint8_t opcode = static_cast<std::uint8_t>(reader.fixed(1));
+        if (opcode >= opcodeBase)
+        {
+          std::uint8_t adjusted = static_cast<std::uint8_t>(opcode - opcodeBase);
+          address += (adjusted / lineRange) * minInstructionLength;
+          line += lineBase + adjusted % lineRange;
+          emit(false);
+          continue;
+        }
+        switch (opcode)
+        {
+        case 0: // extended opcode
+        {
+          std::uint64_t length = reader.uleb();
+          if (!length || length > static_cast<std::uint64_t>(reader.end - reader.pos))
+          {
+            reader.ok = false;
+            break;
+          }
+          const unsigned char *next = reader.pos + length;
+          std::uint8_t extended = static_cast<std::uint8_t>(reader.fixed(1));
+          if (extended == 1) // DW_LNE_end_sequence
+          {
+            emit(true);
+            address = 0;
+            file = 1;
+            line = 1;
+          }
+          else if (extended == 2) // DW_LNE_set_address
+          {
+            address = static_cast<std::uintptr_t>(reader.fixed(static_cast<std::size_t>(length - 1)));
+          }
+          reader.pos = next;
+          break;
+        }
+        case 1: // DW_LNS_copy
+          emit(false);
+          break;
+        case 2: // DW_LNS_advance_pc
+          address += static_cast<std::uintptr_t>(reader.uleb() * minInstructionLength);
+          break;
+        case 3: // DW_LNS_advance_line
+          line += reader.sleb();
+          break;
+        case 4: // DW_LNS_set_file
+          file = reader.uleb();
+          break;
+        case 8: // DW_LNS_const_add_pc
+          address += ((255 - opcodeBase) / lineRange) * minInstructionLength;
+          break;
+        case 9: // DW_LNS_fixed_advance_pc
+          address += static_cast<std::uintptr_t>(reader.fixed(2));
+          break;
+        default:
+          for (std::uint8_t i = 0; i < opcodeLengths[opcode - 1]; ++i)
+          {
+            reader.uleb();
+          }
+        }
+      }
+    }
+  }
+#else
+  void listModules() {}
+  static void load(Module &module)
+  {
+    module.loaded = true;
+  }
+#endif
+
+  Shard shards[kShards];
+  std::mutex modulesMtx;
+  std::vector<std::unique_ptr<Module>> modules;
+};
+#endif
+
+/// @brief Grouping used when aggregating sites in reports
+enum class RollupLevel
+{
+  /// @brief Every call site on its own
+  Site,
+  File,
+  /// @brief Directory of the source file, or the module for functions without line information
+  Directory,
+  Namespace,
+  /// @brief Namespace-qualified class, free functions form one group
+  Class,
+  /// @brief All instantiations of a function template, or of members of a class template
+  Template
+};
+
+const std::size_t kRollupLevelCount = 6;
+
+enum class MetricKind
+{
+  /// @brief CHRONO_COUNT(), a running total
+  Counter,
+  /// @brief CHRONO_GAUGE(), the last value set on any thread
+  Gauge,
+  /// @brief CHRONO_VALUE(), a distribution of samples
+  Value
+};
+
+/// @brief A named metric, shared by every CHRONO_COUNT/GAUGE/VALUE use of the name
+struct MetricInfo
+{
+  std::string name;
+  MetricKind kind;
+  /// @brief First place the metric was registered from
+  std::string fileName;
+  int lineNo;
+};
+
+/// @brief Compile-time description of a RECORD_CALL() site
+struct SiteDescriptor
+{
+  const char *functionName;
+  /// @brief Fully qualified signature, from std::source_location, __PRETTY_FUNCTION__ or __FUNCSIG__
+  const char *signature;
+  const char *fileName;
+  int lineNo;
+};
+
+/// @brief Static description of an instrumented call site
+struct SiteInfo
+{
+  std::string functionName;
+  std::string fileName;
+  int lineNo = 0;
+  std::string identifier;
+  std::string signature;
+  /// @brief Function name with its enclosing namespaces and classes, e.g. "app::Cache<int>::get"
+  std::string qualifiedName;
+  /// @brief Qualified name with the parameters, qualifiers and template arguments, e.g.
+  /// "app::Cache<T>::get() const [with T = int]", tells overloads and instantiations apart
+  std::string displayName;
+  std::string namespaceName;
+  std::string className;
+  /// @brief Qualified name with template arguments removed, shared by all instantiations
+  std::string templateName;
+  /// @brief Dense id of the site's group at each RollupLevel, the Site level id is the site id
+  std::uint32_t groups[kRollupLevelCount] = {};
+};
+
+/// @brief Process-wide table of call sites. Every site gets a dense id
+/// that is shared by the aggregated statistics and the trace events
+class SiteRegistry
+{
+public:
+  static const std::uint32_t kNoSite = UINT32_MAX;
+
+  static SiteRegistry &getInstance()
+  {
+    static SiteRegistry instance;
+    static const bool registered = (ProfilerShutdown::registerSingleton(), true);
+    (void)registered;
+    return instance;
+  }
+
+  std::uint32_t registerSite(const std::string &functionName, const std::string &fileName, int lineNo)
+  {
+    return registerSite(functionName, functionName, fileName, lineNo);
+  }
+
+  std::uint32_t registerSite(const SiteDescriptor &descriptor)
+  {
+    return registerSite(descriptor.functionName, descriptor.signature, descriptor.fileName, descriptor.lineNo);
+  }
+
+  std::uint32_t registerSite(const std::string &functionName, const std::string &signature, const std::string &fileName,
+                             int lineNo)
+  {
+    SiteInfo info;
+    info.functionName = functionName;
+    info.signature = signature;
+    info.fileName = fileName;
+    info.lineNo = lineNo;
+    parseSignature(info);
+    return addSite(std::move(info));
+  }
+
+  /// @brief Registers the phase of a function that ends at a RECORD_CHECKPOINT(), named
+  /// "function/phase" and grouped with the function at every rollup level but Site
+  std::uint32_t registerCheckpoint(const SiteDescriptor &descriptor, const std::string &phase)
+  {
+    return addSubSite(descriptor, phase);
+  }
+
+  /// @brief Id of a tag key or string tag value, the same string always gets the same id
+  std::uint32_t intern(const char *text)
+  {
+    return intern(text, std::strlen(text));
+  }
+
+  std::uint32_t intern(const char *text, std::size_t length)
+  {
+    std::string key(text, length);
+    ProfilerLock lock(mtx);
+    auto it = stringIndex.find(key);
+    if (it != stringIndex.end())
+    {
+      return it->second;
+    }
+    std::uint32_t id = static_cast<std::uint32_t>(stringList.size());
+    stringList.push_back(std::move(key));
+    stringIndex.emplace(stringList.back(), id);
+    return id;
+  }
+
+  const std::string &internedString(std::uint32_t id) const
+  {
+    ProfilerLock lock(mtx);
+    return stringList[id];
+  }
+
+  /// @brief Registers a metric by name and kind, every place using them gets the same dense id
+  std::uint32_t registerMetric(const std::string &name, MetricKind kind, const std::string &fileName, int lineNo)
+  {
+    std::string key = name + "#" + std::to_string(static_cast<int>(kind));
+    ProfilerLock lock(mtx);
+    auto it = metricIndex.find(key);
+    if (it != metricIndex.end())
+    {
+      return it->second;
+    }
+    std::uint32_t id = static_cast<std::uint32_t>(metricList.size());
+    metricList.push_back(MetricInfo{name, kind, fileName, lineNo});
+    metricIndex.emplace(key, id);
+    return id;
+  }
+
+  /// @brief Entries are never removed or modified, so the reference stays valid
+  const MetricInfo &metric(std::uint32_t id) const
+  {
+    ProfilerLock lock(mtx);
+    return metricList[id];
+  }
+
+  std::size_t metricCount() const
+  {
+    ProfilerLock lock(mtx);
+    return metricList.size();
+  }
+
+  /// @brief Registers a site named at runtime, see RECORD_SCOPE_DYNAMIC(). The name is taken as is,
+  /// so every use of the same name gets the same id, identified as "<dynamic>:name"
+  std::uint32_t registerDynamicSite(const std::string &name)
+  {
+    SiteInfo info;
+    info.functionName = name;
+    info.signature = name;
+    info.fileName = "<dynamic>";
+    info.qualifiedName = name;
+    info.displayName = name;
+    info.templateName = name;
+    info.identifier = info.fileName + ":" + name;
+    return addSite(std::move(info));
+  }
+
+  /// @brief Registers a RECORD_LOOP() loop, named "function/loop@line"
+  std::uint32_t registerLoop(const SiteDescriptor &descriptor)
+  {
+    std::stringstream ss;
+    ss << "loop@" << descriptor.lineNo;
+    return addSubSite(descriptor, ss.str());
+  }
+
+private:
+  std::uint32_t addSubSite(const SiteDescriptor &descriptor, const std::string &name)
+  {
+    SiteInfo info;
+    info.functionName = name;
+    info.signature = descriptor.signature;
+    info.fileName = descriptor.fileName;
+    info.lineNo = descriptor.lineNo;
+    parseSignature(info);
+    info.qualifiedName += "/" + name;
+    info.displayName += "/" + name;
+    info.templateName += "/" + name;
+    info.identifier += "/" + name;
+    return addSite(std::move(info));
+  }
+
+  std::uint32_t addSite(SiteInfo info)
+  {
+    ProfilerLock lock(mtx);
+    auto it = index.find(info.identifier);
+    if (it != index.end())
+    {
+      return it->second;
+    }
+
+    std::uint32_t id = static_cast<std::uint32_t>(sites.size());
+    assignGroups(info, id);
+    index.emplace(info.identifier, id);
+    sites.push_back(std::move(info));
+    return id;
+  }
+
+public:
+  /// @brief Looks up a site identified by code address. Returns false for an unknown address,
+  /// id is kNoSite for addresses that were excluded from profiling
+  bool findAddress(void *address, std::uint32_t &id) const
+  {
+    ProfilerLock lock(mtx);
+    auto it = addressIndex.find(address);
+    if (it == addressIndex.end())
+    {
+      return false;
+    }
+    id = it->second;
+    return true;
+  }
+
+#if defined(CHRONOSCOPE_SYMBOLS)
+  /// @brief Registers a function by address. It is symbolized here, outside the lock, so the site
+  /// joins its real rollup groups before its first call is recorded. Addresses that resolve to the
+  /// same function share a site
+  std::uint32_t registerAddress(void *address)
+  {
+    std::uint32_t id = kNoSite;
+    if (findAddress(address, id))
+    {
+      return id;
+    }
+
+    SiteInfo info;
+    const SymbolInfo &symbol = Symbolizer::getInstance().resolve(address);
+    info.signature = symbol.function;
+    info.fileName = symbol.file.empty() ? symbol.module : symbol.file;
+    info.lineNo = symbol.line;
+    parseSignature(info);
+    info.functionName = stripTemplateArguments(lastComponent(info.qualifiedName));
+    id = addSite(std::move(info));
+
+    ProfilerLock lock(mtx);
+    return addressIndex.emplace(address, id).first->second;
+  }
+#endif
+
+  void excludeAddress(void *address)
+  {
+    ProfilerLock lock(mtx);
+    addressIndex.emplace(address, static_cast<std::uint32_t>(kNoSite));
+  }
+
+  /// @brief Entries are never removed, so the reference stays valid
+  const SiteInfo &site(std::uint32_t id) const
+  {
+    ProfilerLock lock(mtx);
+    return sites[id];
+  }
+
+  /// @brief Group ids of the site per RollupLevel, for the recording path. The ids do not change
+  /// once the site is registered
+  const std::uint32_t *groups(std::uint32_t id) const
+  {
+    ProfilerLock lock(mtx);
+    return sites[id].groups;
+  }
+
+  std::size_t size() const
+  {
+    ProfilerLock lock(mtx);
+    return sites.size();
+  }
+
+  /// @brief Name of the group the site belongs to at the given level
+  static std::string groupName(const SiteInfo &info, RollupLevel level)
+  {
+    switch (level)
+    {
+    case RollupLevel::File:
+      return info.fileName;
+    case RollupLevel::Directory:
+    {
+      std::size_t slash = info.fileName.find_last_of("/\\");
+      return slash == std::string::npos ? std::string(".") : info.fileName.substr(0, slash);
+    }
+    case RollupLevel::Namespace:
+      return info.namespaceName.empty() ? "(global namespace)" : info.namespaceName;
+    case RollupLevel::Class:
+      if (info.className.empty())
+        return "(free functions)";
+      return info.namespaceName.empty() ? info.className : info.namespaceName + "::" + info.className;
+    case RollupLevel::Template:
+      return info.templateName;
+    case RollupLevel::Site:
+    default:
+      return info.identifier;
+    }
+  }
+
+private:
+  /// @brief Gives the site a group id per level, called with the lock held once its names are known
+  void assignGroups(SiteInfo &info, std::uint32_t id) const
+  {
+    info.groups[0] = id;
+    for (std::size_t level = 1; level < kRollupLevelCount; ++level)
+    {
+      std::unordered_map<std::string, std::uint32_t> &names = groupIndex[level];
+      auto it = names.emplace(groupName(info, static_cast<RollupLevel>(level)), static_cast<std::uint32_t>(names.size()));
+      info.groups[level] = it.first->second;
+    }
+  }
+
+  /// @brief Splits the signature into qualified name, namespace, class and template name, and
+  /// builds the identifier from the signature without its return type. A lambda, "f(int)::<lambda()>"
+  /// or "f(int)::{lambda()#1}::operator()", keeps its own name and is grouped with the function it is
+  /// defined in. A signature cannot tell a namespace from a class, so the first scope that has
+  /// template arguments or starts with an upper-case letter is taken as the class, as is the last
+  /// scope of a constructor, destructor or const/volatile/ref-qualified member. Any other member of
+  /// a lower-case class is filed under a namespace of that name
+  static void parseSignature(SiteInfo &info)
+  {
+    std::string text = info.signature.empty() ? info.functionName : info.signature;
+    std::size_t with = text.rfind(" [with ");
+    std::string templateArguments;
+    if (with != std::string::npos && text.back() == ']')
+    {
+      templateArguments = text.substr(with);
+      text.erase(with);
+    }
+
+    // The parameter list is the last top-level parenthesis, "operator()" excepted. One followed by
+    // "::" belongs to the function a lambda is defined in
+    std::size_t parameters = std::string::npos;
+    std::size_t closing = std::string::npos;
+    int angles = 0;
+    int parens = 0;
+    int braces = 0;
+    for (std::size_t i = 0; i < text.size(); ++i)
+    {
+      char c = text[i];
+      if (isOperatorAt(text, i))
+      {
+        i = skipOperator(text, i) - 1;
+      }
+      else if (c == '<')
+        angles++;
+      else if (c == '>' && angles > 0)
+        angles--;
+      else if (c == '{')
+        braces++;
+      else if (c == '}')
+        braces--;
+      else if (c == '(')
+      {
+        if (angles == 0 && parens == 0 && braces == 0)
+          parameters = i;
+        parens++;
+      }
+      else if (c == ')')
+      {
+        parens--;
+        if (angles == 0 && parens == 0 && braces == 0)
+          closing = i;
+      }
+    }
+    if (parameters != std::string::npos && text.find("::", closing) != std::string::npos)
+    {
+      parameters = std::string::npos;
+    }
+
+    std::string declarator = parameters == std::string::npos ? text : text.substr(0, parameters);
+    std::string trailer = parameters == std::string::npos ? std::string() : text.substr(parameters);
+
+    // Drop the return type and calling convention, the name is the last top-level word before the
+    // first parenthesis or brace
+    std::size_t nameStart = 0;
+    if (parameters != std::string::npos)
+    {
+      angles = 0;
+      for (std::size_t i = 0; i < declarator.size(); ++i)
+      {
+        char c = declarator[i];
+        if (isOperatorAt(declarator, i) || ((c == '(' || c == '{') && angles == 0))
+        {
+          break;
+        }
+        if (c == '<')
+          angles++;
+        else if (c == '>' && angles > 0)
+          angles--;
+        else if (c == ' ' && angles == 0)
+          nameStart = i + 1;
+      }
+    }
+    info.qualifiedName = declarator.substr(nameStart);
+    while (!info.qualifiedName.empty() && (info.qualifiedName[0] == '*' || info.qualifiedName[0] == '&'))
+    {
+      info.qualifiedName.erase(0, 1);
+    }
+
+    std::vector<std::string> scopes = splitScopes(info.qualifiedName);
+    if (scopes.size() > 1 && scopes.back() == "operator()" && isLambda(scopes[scopes.size() - 2]))
+    {
+      info.qualifiedName.erase(info.qualifiedName.size() - std::strlen("::operator()"));
+      scopes.pop_back();
+    }
+    std::string function = scopes.back();
+    scopes.pop_back();
+    std::size_t trailerClosing = trailer.rfind(')');
+    std::string qualifiers = trailerClosing == std::string::npos ? std::string() : trailer.substr(trailerClosing + 1);
+    for (std::size_t i = 0; i < scopes.size(); ++i)
+    {
+      std::size_t open = scopes[i].find('(');
+      if (open != std::string::npos && open > 0 && !isLambda(scopes[i]))
+      {
+        function = scopes[i].substr(0, open);
+        qualifiers = scopes[i].substr(scopes[i].rfind(')') + 1);
+        scopes.resize(i);
+        break;
+      }
+    }
+    bool member = qualifiers.find("const") != std::string::npos || qualifiers.find("volatile") != std::string::npos ||
+                  qualifiers.find('&') != std::string::npos;
+    std::string bareFunction = stripTemplateArguments(function);
+    if (!bareFunction.empty() && bareFunction[0] == '~')
+    {
+      bareFunction.erase(0, 1);
+    }
+    bool constructor = !scopes.empty() && bareFunction == stripTemplateArguments(scopes.back());
+
+    std::size_t firstClass = scopes.size();
+    for (std::size_t i = 0; i < scopes.size(); ++i)
+    {
+      if (scopes[i].find('<') != std::string::npos || std::isupper(static_cast<unsigned char>(scopes[i][0])) ||
+          ((member || constructor) && i + 1 == scopes.size()))
+      {
+        firstClass = i;
+        break;
+      }
+    }
+    info.namespaceName.clear();
+    info.className.clear();
+    for (std::size_t i = 0; i < scopes.size(); ++i)
+    {
+      std::string &target = i < firstClass ? info.namespaceName : info.className;
+      target += (target.empty() ? "" : "::") + scopes[i];
+    }
+    info.templateName = stripTemplateArguments(info.qualifiedName);
+    info.displayName = info.qualifiedName + trailer + templateArguments;
+
+    std::stringstream ss;
+    ss << info.fileName << ":" << info.lineNo << ":" << info.displayName;
+    info.identifier = ss.str();
+  }
+
+  /// @brief Whether a scope component names a lambda, "<lambda(int)>" and "(anonymous class)" from
+  /// __PRETTY_FUNCTION__ or "{lambda(int)#1}" from the demangler
+  static bool isLambda(const std::string &component)
+  {
+    return component.compare(0, 7, "<lambda") == 0 || component.compare(0, 7, "{lambda") == 0 ||
+           component.compare(0, 17, "(anonymous class)") == 0 || component.compare(0, 7, "(lambda") == 0;
+  }
+
+  static bool isOperatorAt(const std::string &text, std::size_t i)
+  {
+    return text.compare(i, 8, "operator") == 0 && (i == 0 || !(std::isalnum(static_cast<unsigned char>(text[i - 1])) || text[i - 1] == '_')) &&
+           (i + 8 == text.size() || !(std::isalnum(static_cast<unsigned char>(text[i + 8])) || text[i + 8] == '_'));
+  }
+
+  /// @brief Position after the operator name starting at i, e.g. past "operator()" or "operator<<"
+  static std::size_t skipOperator(const std::string &text, std::size_t i)
+  {
+    i += 8;
+    if (text.compare(i, 2, "()") == 0)
+      return i + 2;
+    std::size_t end = i;
+    while (end < text.size() && std::string("<>=!+-*/%^&|~[],").find(text[end]) != std::string::npos)
+    {
+      end++;
+    }
+    return end;
+  }
+
+  /// @brief Splits "a::b<c::d>::f" into top-level scope components
+  static std::vector<std::string> splitScopes(const std::string &name)
+  {
+    std::vector<std::string> parts;
+    std::size_t start = 0;
+    int angles = 0;
+    int parens = 0;
+    int braces = 0;
+    for (std::size_t i = 0; i < name.size(); ++i)
+    {
+      if (isOperatorAt(name, i))
+      {
+        break;
+      }
+      char c = name[i];
+      if (c == '<')
+        angles++;
+      else if (c == '>' && angles > 0)
+        angles--;
+      else if (c == '(')
+        parens++;
+      else if (c == ')')
+        parens--;
+      else if (c == '{')
+        braces++;
+      else if (c == '}')
+        braces--;
+      else if (c == ':' && angles == 0 && parens == 0 && braces == 0 && i + 1 < name.size() && name[i + 1] == ':')
+      {
+        parts.push_back(name.substr(start, i - start));
+        start = i + 2;
+        i++;
+      }
+    }
+    parts.push_back(name.substr(start));
+    return parts;
+  }
+
+  static std::string lastComponent(const std::string &name)
+  {
+    return splitScopes(name).back();
+  }
+
+  /// @brief Removes the template arguments, a "<lambda()>" component is kept whole
+  static std::string stripTemplateArguments(const std::string &name)
+  {
+    std::string result;
+    int angles = 0;
+    for (std::size_t i = 0; i < name.size(); ++i)
+    {
+      if (angles == 0 && isOperatorAt(name, i))
+      {
+        std::size_t end = skipOperator(name, i);
+        result += name.substr(i, end - i);
+        i = end - 1;
+        continue;
+      }
+      if (angles == 0 && name.compare(i, 7, "<lambda") == 0)
+      {
+        std::size_t end = i;
+        for (int depth = 0; end < name.size(); ++end)
+        {
+          depth += name[end] == '<' ? 1 : name[end] == '>' ? -1 : 0;
+          if (depth == 0)
+            break;
+        }
+        result += name.substr(i, end + 1 - i);
+        i = end;
+        continue;
+      }
+      char c = name[i];
+      if (c == '<')
+        angles++;
+      else if (c == '>' && angles > 0)
+        angles--;
+      else if (angles == 0)
+        result += c;
+    }
+    return result;
+  }
+
+  SiteRegistry() {}
+  SiteRegistry(SiteRegistry const &) = delete;
+  void operator=(SiteRegistry const &) = delete;
+
+  mutable std::mutex mtx;
+  mutable std::deque<SiteInfo> sites;
+  std::unordered_map<std::string, std::uint32_t> index;
+  std::unordered_map<void *, std::uint32_t> addressIndex;
+  mutable std::unordered_map<std::string, std::uint32_t> groupIndex[kRollupLevelCount];
+  std::deque<MetricInfo> metricList;
+  std::unordered_map<std::string, std::uint32_t> metricIndex;
+  std::deque<std::string> stringList;
+  std::unordered_map<std::string, std::uint32_t> stringIndex;
+};
+
+enum class TagType : std::uint8_t
+{
+  Int,
+  Double,
+  Bool,
+  /// @brief Interned string, the value is the id from SiteRegistry::intern()
+  String
+};
+
+/// @brief A CHRONO_TAG() annotation, the key is an interned string and the value is
+/// stored as the bits of a long long, a double, a bool or a string id
+struct ScopeTag
+{
+  std::uint32_t key;
+  TagType type;
+  std::uint64_t value;
+};
+
+/// @brief A site and one of its tag values. The overflow group of a site and key stands for
+/// the values past the profiler's tag value limit, its type and value are not used
+struct TagGroup
+{
+  std::uint32_t site;
+  std::uint32_t key;
+  TagType type;
+  std::uint64_t value;
+  bool overflow;
+
+  bool operator<(const TagGroup &other) const
+  {
+    if (site != other.site)
+      return site < other.site;
+    if (key != other.key)
+      return key < other.key;
+    if (overflow != other.overflow)
+      return overflow < other.overflow;
+    if (type != other.type)
+      return type < other.type;
+    return value < other.value;
+  }
+};
+
+enum class TraceEventType : std::uint8_t
+{
+  Open,
+  Close,
+  /// @brief Annotation of the innermost open scope, see TraceEvent
+  Tag
+};
+
+/// @brief A scope open/close event, timestamped in ns since the profiler was created.
+/// A Tag event reuses the fields: at holds the tag value, site the key and the tag type
+/// follows in tagType
+struct TraceEvent
+{
+  long long at;
+  std::uint32_t site;
+  TraceEventType type;
+  TagType tagType;
+};
+
+/// @brief A finished scope queued for the span exporter
+struct SpanRecord
+{
+  std::uint64_t traceIdHigh;
+  std::uint64_t traceIdLow;
+  std::uint64_t spanId;
+  std::uint64_t parentSpanId;
+  std::uint32_t site;
+  bool request;
+  long long start;
+  long long end;
+  std::uint8_t tagCount;
+  ScopeTag tags[4];
+};
+
+/// @brief An entry of the per-thread scope stack
+struct ScopeFrame
+{
+  std::uint32_t site;
+  /// @brief The site's group id per RollupLevel
+  const std::uint32_t *groups;
+  /// @brief Bit per RollupLevel, set when no enclosing scope of the thread is in the same group
+  std::uint32_t outermost;
+  /// @brief Number of activations of the site open on the thread, this one included
+  std::uint32_t recursionDepth;
+  /// @brief Nanoseconds spent in nested scopes that already closed
+  long long childTime;
+  /// @brief Time of the scope's last checkpoint, or its start, as the profiler clock's ticks since its epoch
+  long long lap;
+  /// @brief childTime at the last checkpoint
+  long long lapChildTime;
+  bool traced;
+  bool request;
+  std::uint64_t traceIdHigh;
+  std::uint64_t traceIdLow;
+  std::uint64_t spanId;
+  /// @brief CHRONO_TAG() annotations of the scope, the ones past the capacity are dropped
+  std::uint8_t tagCount;
+  ScopeTag tags[4];
+  /// @brief Set by RECORD_CALL_LABEL() scopes, with the LabelTable slot of the label
+  bool labelled;
+  std::uint32_t labelSlot;
+  std::uint32_t labelGeneration;
+};
+
+#if defined(CHRONOSCOPE_SAMPLING)
+/// @brief A stack captured by the SIGPROF handler
+struct StackSample
+{
+  static const std::uint32_t kMaxFrames = 48;
+  static const std::uint32_t kMaxScopes = 16;
+
+  long long at;
+  std::uint32_t frameCount;
+  std::uint32_t scopeCount;
+  void *frames[kMaxFrames];
+  std::uint32_t scopes[kMaxScopes];
+};
+
+/// @brief Single-producer single-consumer ring, filled by the signal handler of its thread
+struct SampleRing
+{
+  static const std::uint32_t kCapacity = 1024;
+
+  StackSample slots[kCapacity];
+  std::atomic<std::uint32_t> head{0};
+  std::atomic<std::uint32_t> tail{0};
+  std::atomic<std::size_t> dropped{0};
+};
+
+/// @brief A sample moved out of the ring, native frames leaf first and
+/// the innermost instrumented scopes outermost first
+struct RecordedSample
+{
+  long long at;
+  std::vector<void *> frames;
+  std::vector<std::uint32_t> scopes;
+};
+#endif
+
+/// @brief Scope stack of the -finstrument-functions hooks, kept apart from the Timer frames
+/// because excluded functions still have to be matched between enter and exit
+struct FunctionHookState
+{
+  struct Frame
+  {
+    /// @brief Address the enter hook was called with, matched by the exit hook
+    void *function;
+    std::uint32_t site;
+    /// @brief Ticks of the profiler clock since its epoch
+    long long start;
+  };
+
+  Frame frames[256];
+  std::uint32_t depth = 0;
+  /// @brief Per-thread cache of the registry's address lookups
+  std::unordered_map<void *, std::uint32_t> sites;
+};
+
+/// @brief Direct-mapped cache of a thread's SiteRegistry::intern() ids, looked up by content so
+/// repeated strings neither allocate nor take the registry lock
+struct InternCache
+{
+  static const std::size_t kEntries = 64;
+
+  struct Entry
+  {
+    std::uint64_t hash = 0;
+    /// @brief The registry's copy of the string, which never moves
+    const char *text = nullptr;
+    std::size_t length = 0;
+    std::uint32_t id = 0;
+  };
+
+  Entry entries[kEntries];
+};
+
+/// @brief Direct-mapped cache of a thread's exact RECORD_CALL_LABEL() slots, looked up by site and
+/// label content so repeated labels neither allocate nor lock before the scope starts
+struct LabelCache
+{
+  static const std::size_t kEntries = 64;
+
+  struct Entry
+  {
+    std::uint64_t hash = 0;
+    std::uint32_t site = 0;
+    /// @brief The label table's copy of the label, which never moves
+    const char *text = nullptr;
+    std::size_t length = 0;
+    std::uint32_t slot = 0;
+  };
+
+  Entry entries[kEntries];
+};
+
+/// @brief A thread's share of a metric
+struct MetricCell
+{
+  std::uint64_t count = 0;
+  double sum = 0;
+  double min = 0;
+  double max = 0;
+  double last = 0;
+  /// @brief When a gauge was last set, relative to the profiler's epoch
+  long long lastAt = 0;
+  std::unique_ptr<LatencyHistogram> histogram;
+};
+
+/// @brief A thread's share of a site's statistics
+struct SiteCell
+{
+  ProfileInfo info;
+  /// @brief Time of the site's scopes that were outermost in their group at each RollupLevel
+  long long outermost[kRollupLevelCount] = {};
+  /// @brief Call durations, kept by StatisticsMode::Histogram profilers
+  std::unique_ptr<LatencyHistogram> histogram;
+};
+
+/// @brief Per-thread profiler state. The scope stack is only touched by the owning thread
+/// (and its signal handler), the mutex guards the buffers that exporters drain concurrently
+struct ThreadState
+{
+  static const std::uint32_t kMaxScopeDepth = 256;
+
+  std::uint32_t threadIndex = 0;
+  ScopeFrame stack[kMaxScopeDepth];
+  std::atomic<std::uint32_t> depth{0};
+  std::mt19937_64 idGenerator;
+
+  mutable std::mutex mtx;
+  /// @brief Ring of the latest trace events, event n is at n % events.size() once it wraps
+  std::vector<TraceEvent> events;
+  /// @brief Events pushed since the thread started, the ring holds the last events.size() of them
+  std::uint64_t eventCount = 0;
+  /// @brief Events overwritten or not kept for lack of capacity
+  std::size_t dropped = 0;
+  std::vector<SpanRecord> spans;
+  std::size_t droppedSpans = 0;
+  /// @brief Site statistics of the thread, indexed by site id
+  std::vector<SiteCell> sites;
+  /// @brief Metric shards of the thread, indexed by metric id
+  std::vector<MetricCell> metrics;
+  /// @brief Totals of the thread's tagged calls per site and tag value
+  std::map<TagGroup, ProfileInfo> tags;
+
+  std::unique_ptr<FunctionHookState> hooks;
+
+  /// @brief Group ids already looked up by this thread, indexed by site id
+  std::vector<const std::uint32_t *> siteGroups;
+  /// @brief Ids of the RECORD_SCOPE_DYNAMIC() names this thread has used
+  std::unordered_map<std::string, std::uint32_t> dynamicSites;
+  /// @brief Ids of the CHRONO_TAG() string values this thread has used
+  InternCache strings;
+  /// @brief Exact label slots this thread has used
+  LabelCache labels;
+  /// @brief Number of open scopes per group id, for every RollupLevel
+  std::vector<std::uint32_t> activeGroups[kRollupLevelCount];
+
+#if defined(CHRONOSCOPE_SAMPLING)
+  std::uint32_t samplingGeneration = 0;
+  bool samplingArmed = false;
+  timer_t samplingTimer;
+  std::unique_ptr<SampleRing> sampleRing;
+  std::vector<RecordedSample> samples;
+#endif
+};
+
+/// @brief Settings of the OTLP/JSON span exporter
+struct OtlpExportOptions
+{
+  std::string serviceName = "chronoscope";
+  std::vector<std::pair<std::string, std::string>> resourceAttributes;
+  /// @brief Maximum number of spans written per line (one ExportTraceServiceRequest each)
+  std::size_t batchSize = 512;
+  std::chrono::milliseconds flushInterval{1000};
+  /// @brief Spans queued per thread before new ones are dropped
+  std::size_t maxQueuedSpans = 1 << 16;
+};
+
+/// @brief Background thread running a task at a fixed interval, and once more when stopped
+class PeriodicWorker
+{
+public:
+  PeriodicWorker() {}
+  PeriodicWorker(PeriodicWorker const &) = delete;
+  void operator=(PeriodicWorker const &) = delete;
+
+  ~PeriodicWorker()
+  {
+    stop();
+  }
+
+  bool start(std::chrono::milliseconds interval, std::function<void()> task)
+  {
+    std::lock_guard<std::mutex> controlLock(controlMtx);
+    if (thread.joinable())
+    {
+      return false;
+    }
+    stopping = false;
+    thread = std::thread(
+        [this, interval, task]()
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          for (;;)
+          {
+            bool last = cv.wait_for(lock, interval, [this]() { return stopping; });
+            lock.unlock();
+            task();
+            if (last)
+            {
+              break;
+            }
+            lock.lock();
+          }
+        });
+    return true;
+  }
+
+  void stop()
+  {
+    std::lock_guard<std::mutex> controlLock(controlMtx);
+    if (!thread.joinable())
+    {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      stopping = true;
+    }
+    cv.notify_all();
+    thread.join();
+  }
+
+  bool running() const
+  {
+    std::lock_guard<std::mutex> controlLock(controlMtx);
+    return thread.joinable();
+  }
+
+private:
+  mutable std::mutex controlMtx;
+  std::mutex mtx;
+  std::condition_variable cv;
+  std::thread thread;
+  bool stopping = false;
+};
+
+/// @brief Clock whose reading is a shared timestamp refreshed by a background thread, so now()
+/// is a single relaxed load. Until start() runs the ticker, now() reads steady_clock, the
+/// ticker's own time base. Once started, its resolution is the period
+struct TickerClock
+{
+  using rep = long long;
+  using period = std::nano;
+  using duration = std::chrono::nanoseconds;
+  using time_point = std::chrono::time_point<TickerClock>;
+  static constexpr bool is_steady = true;
+
+  static const char *name()
+  {
+    return "ticker thread";
+  }
+
+  static time_point now() noexcept
+  {
+    long long ticks = timestamp().load(std::memory_order_relaxed);
+    if (!ticks)
+    {
+      ticks = steadyTicks();
+    }
+    return time_point(duration(ticks));
+  }
+
+  /// @brief Starts the ticker, returns false when it already runs. Meant for program startup:
+  /// a scope open across the call may end on a reading up to one period behind its start
+  static bool start(std::chrono::milliseconds interval = std::chrono::milliseconds(1))
+  {
+    static std::mutex mtx;
+    std::lock_guard<std::mutex> lock(mtx);
+    if (timestamp().load(std::memory_order_relaxed))
+    {
+      return false;
+    }
+    tick();
+    tickInterval().store(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count(),
+                         std::memory_order_relaxed);
+    return worker().start(interval, &TickerClock::tick);
+  }
+
+  static std::chrono::nanoseconds resolution()
+  {
+    return std::chrono::nanoseconds(tickInterval().load(std::memory_order_relaxed));
+  }
+
+private:
+  static long long steadyTicks() noexcept
+  {
+    return std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static void tick()
+  {
+    // Never 0, which marks a ticker that has not started
+    long long now = steadyTicks();
+    timestamp().store(now ? now : 1, std::memory_order_relaxed);
+  }
+
+  static std::atomic<long long> &timestamp()
+  {
+    static std::atomic<long long> ticks{0};
+    return ticks;
+  }
+
+  static std::atomic<long long> &tickInterval()
+  {
+    // steady_clock's nanosecond until the ticker starts
+    static std::atomic<long long> interval{1};
+    return interval;
+  }
+
+  static PeriodicWorker &worker()
+  {
+    static PeriodicWorker ticker;
+    return ticker;
+  }
+};
+
+/// @brief Optional members of a clock policy, with their defaults for clocks that lack them
+template <typename Clock>
+struct ClockTraits
+{
+  /// @brief The clock's resolution() when it has one, its tick period otherwise
+  static std::chrono::nanoseconds resolution()
+  {
+    return resolution<Clock>(nullptr);
+  }
+
+  /// @brief Reading that ends a measurement, the clock's stop() when it has one
+  static typename Clock::time_point stop()
+  {
+    return stop<Clock>(nullptr);
+  }
+
+  /// @brief Counter ticks per nanosecond, 0 for clocks that do not count cycles
+  static double cyclesPerNs()
+  {
+    return cyclesPerNs<Clock>(nullptr);
+  }
+
+  /// @brief The clock's name() when it has one
+  static std::string name()
+  {
+    return name<Clock>(nullptr);
+  }
+
+private:
+  template <typename C>
+  static std::string name(decltype(&C::name))
+  {
+    return C::name();
+  }
+
+  template <typename C>
+  static std::string name(...)
+  {
+    // high_resolution_clock is an alias of one of the other two in the common standard libraries
+    return std::is_same<C, std::chrono::steady_clock>::value    ? "steady_clock"
+           : std::is_same<C, std::chrono::system_clock>::value ? "system_clock (not monotonic)"
+                                                                 : "high_resolution_clock";
+  }
+
+  template <typename C>
+  static std::chrono::nanoseconds resolution(decltype(&C::resolution))
+  {
+    return C::resolution();
+  }
+
+  template <typename C>
+  static std::chrono::nanoseconds resolution(...)
+  {
+    std::chrono::nanoseconds tick = std::chrono::duration_cast<std::chrono::nanoseconds>(typename C::duration(1));
+    return tick.count() > 0 ? tick : std::chrono::nanoseconds(1);
+  }
+
+  template <typename C>
+  static typename C::time_point stop(decltype(&C::stop))
+  {
+    return C::stop();
+  }
+
+  template <typename C>
+  static typename C::time_point stop(...)
+  {
+    return C::now();
+  }
+
+  template <typename C>
+  static double cyclesPerNs(decltype(&C::cyclesPerNs))
+  {
+    return C::cyclesPerNs();
+  }
+
+  template <typename C>
+  static double cyclesPerNs(...)
+  {
+    return 0;
+  }
+};
+
+/// @brief Connected non-blocking UDP socket, sends never wait for buffer space
+class UdpSocket
+{
+public:
+  UdpSocket() {}
+  UdpSocket(UdpSocket const &) = delete;
+  void operator=(UdpSocket const &) = delete;
+
+  ~UdpSocket()
+  {
+    close();
+  }
+
+  /// @brief Connects to host:port, closing the socket opened before if any
+  bool open(const std::string &host, std::uint16_t port)
+  {
+    close();
+#if defined(_WIN32)
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+    {
+      return false;
+    }
+    wsaStarted = true;
+#endif
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *addresses = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+    {
+      return false;
+    }
+    for (addrinfo *address = addresses; address; address = address->ai_next)
+    {
+      handle = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if (handle == kInvalidSocket)
+      {
+        continue;
+      }
+      if (connect(handle, address->ai_addr, static_cast<int>(address->ai_addrlen)) == 0)
+      {
+        break;
+      }
+      closeHandle();
+    }
+    freeaddrinfo(addresses);
+    if (handle == kInvalidSocket)
+    {
+      return false;
+    }
+#if defined(_WIN32)
+    u_long nonBlocking = 1;
+    ioctlsocket(handle, FIONBIO, &nonBlocking);
+#else
+    fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
+#endif
+    return true;
+  }
+
+  bool send(const std::string &datagram)
+  {
+    if (handle == kInvalidSocket)
+    {
+      return false;
+    }
+    return ::send(handle, datagram.data(), static_cast<int>(datagram.size()), 0) == static_cast<int>(datagram.size());
+  }
+
+  void close()
+  {
+    closeHandle();
+#if defined(_WIN32)
+    if (wsaStarted)
+    {
+      WSACleanup();
+      wsaStarted = false;
+    }
+#endif
+  }
+
+private:
+  void closeHandle()
+  {
+    if (handle != kInvalidSocket)
+    {
+#if defined(_WIN32)
+      closesocket(handle);
+#else
+      ::close(handle);
+#endif
+      handle = kInvalidSocket;
+    }
+  }
+
+#if defined(_WIN32)
+  using Handle = SOCKET;
+  static constexpr Handle kInvalidSocket = INVALID_SOCKET;
+  bool wsaStarted = false;
+#else
+  using Handle = int;
+  static constexpr Handle kInvalidSocket = -1;
+#endif
+  Handle handle = kInvalidSocket;
+};
+
+/// @brief Settings of the StatsD exporter
+struct StatsdExportOptions
+{
+  std::string host = "127.0.0.1";
+  std::uint16_t port = 8125;
+  std::string prefix = "chronoscope";
+  std::chrono::milliseconds interval{10000};
+  /// @brief Upper bound of a datagram, the default fits an Ethernet MTU with IP/UDP headers.
+  /// Lines longer than this are not sent, see Profiler::statsdOversizeLines()
+  std::size_t maxPacketSize = 1432;
+  /// @brief Use DogStatsD tags for the site instead of encoding it in the metric name
+  bool dogstatsd = false;
+  /// @brief Extra DogStatsD tags in key:value form, sent with every metric
+  std::vector<std::string> tags;
+};
+
+/// @brief Time a site took within one frame
+struct FrameSiteTime
+{
+  std::uint32_t site;
+  std::uint64_t count;
+  long long selfDuration;
+};
+
+/// @brief One beginFrame()/endFrame() interval, times are in nanoseconds
+struct FrameRecord
+{
+  std::uint64_t index = 0;
+  /// @brief Start of the frame, relative to the profiler's epoch
+  long long start = 0;
+  long long duration = 0;
+  bool overBudget = false;
+  /// @brief Scopes closed during the frame on any thread, by self time, largest first
+  std::vector<FrameSiteTime> sites;
+};
+
+/// @brief A metric merged over all threads
+struct MetricSnapshot
+{
+  std::uint32_t id = 0;
+  std::string name;
+  MetricKind kind = MetricKind::Counter;
+  std::uint64_t count = 0;
+  double sum = 0;
+  double min = 0;
+  double max = 0;
+  /// @brief Latest gauge value
+  double last = 0;
+  /// @brief Samples of a CHRONO_VALUE() metric, rounded, negative ones counted as zero
+  LatencyHistogram histogram;
+};
+
+/// @brief A RECORD_CALL_BUDGET() scope that ran longer than its budget, times are in nanoseconds
+struct BudgetViolation
+{
+  std::uint32_t site;
+  long long duration;
+  long long budget;
+  /// @brief Index of the thread that closed the scope, as in the timeline exports
+  std::uint32_t threadIndex;
+};
+
+/// @brief Latency objective of a site: the target fraction of calls must finish within the threshold
+struct LatencyObjective
+{
+  std::chrono::microseconds threshold{1000};
+  double target = 0.99;
+  /// @brief Rolling windows the burn rate is computed over, at a 10 s resolution
+  std::vector<std::chrono::seconds> windows{std::chrono::seconds(300), std::chrono::seconds(3600)};
+  /// @brief Number of slowest calls kept per site
+  std::size_t worstCalls = 10;
+};
+
+/// @brief Calls of a site within one rolling window. A burn rate of 1 spends the error
+/// budget exactly as fast as the objective allows
+struct ObjectiveWindow
+{
+  std::chrono::seconds window;
+  std::uint64_t good;
+  std::uint64_t bad;
+  double burnRate;
+};
+
+/// @brief A slow call, times are in nanoseconds and relative to the profiler's epoch
+struct SlowCall
+{
+  long long duration;
+  long long at;
+};
+
+/// @brief Self-test of the profiler's clock, durations are in nanoseconds
+struct ClockQuality
+{
+  std::string source;
+  /// @brief Smallest step seen between two consecutive readings
+  long long resolution = 0;
+  /// @brief Mean cost of one reading
+  double readCost = 0;
+  std::uint64_t reads = 0;
+  /// @brief Consecutive readings on one thread that went back in time
+  std::uint64_t backwardSteps = 0;
+  /// @brief Set for per-core counters such as the TSC, when the skew test could run on several CPUs
+  bool skewMeasured = false;
+  /// @brief Largest amount a reading on one CPU was behind an earlier reading on another
+  long long maxSkew = 0;
+};
+
+/// @brief Current state of a site with a latency objective
+struct ObjectiveStatus
+{
+  std::uint32_t site = 0;
+  LatencyObjective objective;
+  std::uint64_t good = 0;
+  std::uint64_t bad = 0;
+  std::vector<ObjectiveWindow> windows;
+  /// @brief Slowest calls since the start, slowest first
+  std::vector<SlowCall> worst;
+};
+
+/// @brief A profiler class that records the number of calls to a function/method
+/// and the time spent in a function/method. getInstance() is the process-wide profiler, further
+/// instances keep their own statistics, traces and exporters while sharing the SiteRegistry
+template <typename Policy>
+class BasicProfiler
+{
+  template <typename>
+  friend class BasicTimer;
+  template <typename>
+  friend class BasicLoopTimer;
+  template <typename>
+  friend class BasicScopedProfiler;
+
+public:
+  using Clock = typename Policy::Clock;
+  using TimePoint = typename Clock::time_point;
+  using Duration = typename Clock::duration;
+
+  static constexpr bool kBenchmark = Policy::kBenchmark;
+  /// @brief False for count-only profilers. Their scopes never read the clock, so they also skip
+  /// tracing, frames, budgets and latency objectives
+  static constexpr bool kTimed = Policy::kStatistics != StatisticsMode::CountOnly;
+  static constexpr TraceSink kTraceSink = kTimed ? Policy::kTraceSink : TraceSink::None;
+
+  /// @brief Clock reading for scope boundaries, skipped by count-only profilers
+  static TimePoint scopeTime()
+  {
+    return kTimed ? Clock::now() : TimePoint();
+  }
+
+  /// @brief Clock reading that closes a scope, serialized after the scope's code by clocks with a stop()
+  static TimePoint scopeEndTime()
+  {
+    return kTimed ? ClockTraits<Clock>::stop() : TimePoint();
+  }
+
+  static BasicProfiler &getInstance()
+  {
+    static BasicProfiler instance;
+    static const bool registered = (ProfilerShutdown::registerSingleton(), true);
+    (void)registered;
+    return instance;
+  }
+
+  /// @brief The profiler the RECORD_* macros of the calling thread report to: the one selected
+  /// by the innermost ScopedProfiler, or getInstance()
+  static BasicProfiler &current()
+  {
+    BasicProfiler *selected = currentProfiler();
+    return selected ? *selected : getInstance();
+  }
+
+  BasicProfiler()
+      : instanceId(nextInstanceId().fetch_add(1, std::memory_order_relaxed)), epoch(Clock::now()),
+        wallEpoch(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+  {
+    if (Policy::kBenchmark)
+    {
+      baseline = measureBaseline();
+    }
+    ProfilerLock lock(instancesMutex());
+    liveInstances().emplace(instanceId, this);
+  }
+
+  ~BasicProfiler()
+  {
+    {
+      ProfilerLock lock(instancesMutex());
+      liveInstances().erase(instanceId);
+    }
+    stopOtlpExport();
+    stopStatsdExport();
+    budgetWorker.stop();
+#if defined(CHRONOSCOPE_SAMPLING)
+    stopSampling();
+#endif
+  }
+
+  BasicProfiler(BasicProfiler const &) = delete;
+  BasicProfiler(BasicProfiler &&) = delete;
+  void operator=(BasicProfiler const &) = delete;
+  void operator=(BasicProfiler &&) = delete;
+
+  /// @brief Measures the clock on first use: its resolution, the cost of a reading, whether it
+  /// ever steps back and, for per-core counters, the skew between CPUs. Takes a few milliseconds
+  const ClockQuality &clockQuality() const
+  {
+    std::call_once(clockTested, [this]() { clockTest = testClock(); });
+    return clockTest;
+  }
+
+  /// @brief Adds the totals of other to this profiler: site statistics, rollups, loop iterations,
+  /// tag groups and metrics. Traces, spans, frames, objectives and label tables stay with other
+  void merge(const BasicProfiler &other)
+  {
+    if (&other == this)
+    {
+      return;
+    }
+    std::vector<MetricSnapshot> otherMetrics = other.metrics();
+    std::vector<SiteCell> otherSites = other.siteTotals(true);
+    std::vector<std::pair<std::uint32_t, LatencyHistogram>> otherLoops;
+    // The tag values of other count against the value limit of this profiler
+    std::vector<std::pair<TagGroup, ProfileInfo>> otherTags;
+    for (const auto &tagged : other.tagTotals())
+    {
+      otherTags.emplace_back(admitTag(tagged.first), tagged.second);
+    }
+    {
+      // Copied out first, so the locks of the two profilers are never held together
+      ProfilerLock lock(other.mtx);
+      for (const auto &loop : other.iterationHistograms)
+      {
+        otherLoops.emplace_back(loop.first, *loop.second);
+      }
+    }
+
+    ProfilerLock lock(mtx);
+    addCells(mergedSites, otherSites, true);
+    for (const auto &loop : otherLoops)
+    {
+      std::unique_ptr<LatencyHistogram> &histogram = iterationHistograms[loop.first];
+      if (!histogram)
+      {
+        histogram.reset(new LatencyHistogram());
+      }
+      histogram->merge(loop.second);
+    }
+    for (const auto &tagged : otherTags)
+    {
+      addProfile(tagData[tagged.first], tagged.second);
+    }
+    if (otherMetrics.size() > mergedMetrics.size())
+    {
+      mergedMetrics.resize(otherMetrics.size());
+    }
+    for (const MetricSnapshot &metric : otherMetrics)
+    {
+      if (!metric.count)
+      {
+        continue;
+      }
+      MetricCell &cell = mergedMetrics[metric.id];
+      cell.min = cell.count && cell.min < metric.min ? cell.min : metric.min;
+      cell.max = cell.count && cell.max > metric.max ? cell.max : metric.max;
+      cell.count += metric.count;
+      cell.sum += metric.sum;
+      cell.last = metric.last;
+      cell.lastAt = -1;
+      if (metric.kind == MetricKind::Value)
+      {
+        if (!cell.histogram)
+        {
+          cell.histogram.reset(new LatencyHistogram());
+        }
+        cell.histogram->merge(metric.histogram);
+      }
+    }
+  }
+
+  /// @brief Clears the recorded statistics: site totals, rollups, loop iterations, labels, tags,
+  /// metrics, frame history and objective counts. Settings, traces, queued spans and the open
+  /// frame stay. A scope open during the reset adds its whole duration to the new totals
+  void reset()
+  {
+    resetGeneration.fetch_add(1, std::memory_order_relaxed);
+    {
+      ProfilerLock lock(mtx);
+      mergedSites.clear();
+      iterationHistograms.clear();
+      tagData.clear();
+      mergedMetrics.clear();
+      recentFramesRing.clear();
+      worstFrame = FrameRecord();
+      frameTimes = LatencyHistogram();
+      overBudgetFrames = 0;
+      overrunSites.clear();
+      for (ObjectiveTracker &tracker : objectiveTrackers)
+      {
+        tracker.good = 0;
+        tracker.bad = 0;
+        std::fill(tracker.slots.begin(), tracker.slots.end(), typename ObjectiveTracker::Slot());
+        tracker.worst.clear();
+      }
+    }
+    {
+      ProfilerLock lock(tagMtx);
+      tagValues.clear();
+      tagValueCounts.clear();
+    }
+    {
+      ProfilerLock lock(labelMtx);
+      for (auto &table : labelTables)
+      {
+        table.second.clear();
+      }
+    }
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      state->sites.clear();
+      state->metrics.clear();
+      state->tags.clear();
+    }
+  }
+
+  void recordTimeAndCalls(const std::string &functionName, const std::string &fileName, int lineNo, long long duration)
+  {
+    recordSite(SiteRegistry::getInstance().registerSite(functionName, fileName, lineNo), duration);
+  }
+
+  /// @brief Records a call made outside any scope, all of its time is self time. Duration is in microseconds
+  void recordSite(std::uint32_t site, long long duration)
+  {
+    recordSite(localState(), site, duration * 1000, duration * 1000, (1u << kRollupLevelCount) - 1, 1);
+  }
+
+  /// @brief Ends the current phase of the thread's innermost scope, recording the time since the
+  /// scope's previous checkpoint (or its start) under the checkpoint's site. The phase becomes a
+  /// child of the scope, it is not part of the timeline or span exports
+  void checkpoint(std::uint32_t site)
+  {
+    ThreadState &state = localState();
+    std::uint32_t depth = state.depth.load(std::memory_order_relaxed);
+    if (!depth || depth > ThreadState::kMaxScopeDepth)
+    {
+      return;
+    }
+
+    TimePoint now = scopeTime();
+    ScopeFrame &frame = state.stack[depth - 1];
+    long long duration = std::chrono::duration_cast<std::chrono::nanoseconds>(now - TimePoint(Duration(frame.lap))).count();
+    long long selfDuration = duration - (frame.childTime - frame.lapChildTime);
+    frame.childTime += selfDuration;
+    frame.lap = now.time_since_epoch().count();
+    frame.lapChildTime = frame.childTime;
+    recordSite(state, site, duration, selfDuration, openGroupsMask(state, site), 1);
+  }
+
+  /// @brief Starts a frame (tick): scopes that close until endFrame() are attributed to it.
+  /// A frame still open is ended first. Count-only profilers keep no frames
+  void beginFrame()
+  {
+    if (!kTimed)
+    {
+      return;
+    }
+    auto now = Clock::now();
+    ProfilerLock lock(mtx);
+    if (frameOpen)
+    {
+      finishFrame(now);
+    }
+    frameOpen = true;
+    frameStart = now;
+    frameIndex++;
+  }
+
+  void endFrame()
+  {
+    if (!kTimed)
+    {
+      return;
+    }
+    auto now = Clock::now();
+    ProfilerLock lock(mtx);
+    if (frameOpen)
+    {
+      finishFrame(now);
+    }
+  }
+
+  /// @brief Frames longer than the budget are flagged, zero disables the check
+  void setFrameBudget(std::chrono::microseconds budget)
+  {
+    ProfilerLock lock(mtx);
+    frameBudget = std::chrono::duration_cast<std::chrono::nanoseconds>(budget).count();
+  }
+
+  /// @brief Number of finished frames kept with their per-site breakdown
+  void setFrameHistory(std::size_t frames)
+  {
+    ProfilerLock lock(mtx);
+    frameHistory = frames;
+    while (recentFramesRing.size() > frameHistory)
+    {
+      recentFramesRing.pop_front();
+    }
+  }
+
+  /// @brief The last finished frames, oldest first
+  std::vector<FrameRecord> recentFrames() const
+  {
+    ProfilerLock lock(mtx);
+    return std::vector<FrameRecord>(recentFramesRing.begin(), recentFramesRing.end());
+  }
+
+  /// @brief Annotates the thread's innermost open scope, see CHRONO_TAG(). Scopes keep up to four tags
+  template <typename T>
+  typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type tag(std::uint32_t key,
+                                                                                                  T value)
+  {
+    addTag(key, TagType::Int, static_cast<std::uint64_t>(static_cast<long long>(value)));
+  }
+
+  template <typename T>
+  typename std::enable_if<std::is_floating_point<T>::value>::type tag(std::uint32_t key, T value)
+  {
+    double number = static_cast<double>(value);
+    std::uint64_t bits = 0;
+    std::memcpy(&bits, &number, sizeof(bits));
+    addTag(key, TagType::Double, bits);
+  }
+
+  void tag(std::uint32_t key, bool value)
+  {
+    addTag(key, TagType::Bool, value ? 1 : 0);
+  }
+
+  /// @brief String values are interned, meant for values with few distinct strings. A value the
+  /// thread used recently is found in its cache without allocating or locking
+  void tag(std::uint32_t key, const char *value)
+  {
+    addTag(key, TagType::String, internedId(value, std::strlen(value)));
+  }
+
+  void tag(std::uint32_t key, const std::string &value)
+  {
+    addTag(key, TagType::String, internedId(value.c_str(), value.size()));
+  }
+
+  /// @brief Totals of the tagged calls per group and tag value, heaviest first. Every call adds
+  /// its inclusive time, so nested tagged scopes of one group are counted at each level
+  std::vector<std::pair<std::string, ProfileInfo>> rollupByTag(const std::string &key,
+                                                               RollupLevel level = RollupLevel::Site) const
+  {
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::uint32_t keyId = registry.intern(key.c_str());
+    std::vector<std::pair<std::string, ProfileInfo>> entries;
+    std::unordered_map<std::string, std::size_t> groups;
+    for (const auto &tagged : tagTotals())
+    {
+      if (tagged.first.key != keyId)
+      {
+        continue;
+      }
+      ScopeTag value{tagged.first.key, tagged.first.type, tagged.first.value};
+      std::string name = SiteRegistry::groupName(registry.site(tagged.first.site), level) + " [" + key + "=" +
+                         (tagged.first.overflow ? std::string("(other values)") : tagText(value)) + "]";
+      auto it = groups.find(name);
+      if (it == groups.end())
+      {
+        it = groups.emplace(name, entries.size()).first;
+        entries.emplace_back(name, ProfileInfo());
+      }
+      ProfileInfo &total = entries[it->second].second;
+      total.count += tagged.second.count;
+      total.duration += tagged.second.duration;
+      total.selfDuration += tagged.second.selfDuration;
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const std::pair<std::string, ProfileInfo> &a, const std::pair<std::string, ProfileInfo> &b)
+              { return a.second.duration > b.second.duration; });
+    return entries;
+  }
+
+  /// @brief Adds an update to the calling thread's shard of the metric: the delta of a counter,
+  /// the new value of a gauge or a sample of a value. Kind is the kind the metric was registered with
+  void recordMetric(std::uint32_t metric, MetricKind kind, double value)
+  {
+    ThreadState &state = localState();
+    long long at = kind == MetricKind::Gauge ? sinceEpoch(Clock::now()) : 0;
+    ProfilerLock lock(state.mtx);
+    if (metric >= state.metrics.size())
+    {
+      state.metrics.resize(metric + 1);
+    }
+    MetricCell &cell = state.metrics[metric];
+    if (!cell.count || value < cell.min)
+    {
+      cell.min = value;
+    }
+    if (!cell.count || value > cell.max)
+    {
+      cell.max = value;
+    }
+    cell.count++;
+    cell.sum += value;
+    cell.last = value;
+    cell.lastAt = at;
+    if (kind == MetricKind::Value)
+    {
+      if (!cell.histogram)
+      {
+        cell.histogram.reset(new LatencyHistogram());
+      }
+      cell.histogram->record(value > 0 ? static_cast<std::uint64_t>(value + 0.5) : 0);
+    }
+  }
+
+  /// @brief Every metric merged over the thread shards, in registration order
+  std::vector<MetricSnapshot> metrics() const
+  {
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::vector<MetricSnapshot> result(registry.metricCount());
+    std::vector<long long> lastAt(result.size(), -1);
+    for (std::uint32_t id = 0; id < result.size(); ++id)
+    {
+      const MetricInfo &info = registry.metric(id);
+      result[id].id = id;
+      result[id].name = info.name;
+      result[id].kind = info.kind;
+    }
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      for (std::uint32_t id = 0; id < state->metrics.size() && id < result.size(); ++id)
+      {
+        const MetricCell &cell = state->metrics[id];
+        if (!cell.count)
+        {
+          continue;
+        }
+        MetricSnapshot &total = result[id];
+        if (!total.count || cell.min < total.min)
+        {
+          total.min = cell.min;
+        }
+        if (!total.count || cell.max > total.max)
+        {
+          total.max = cell.max;
+        }
+        total.count += cell.count;
+        total.sum += cell.sum;
+        if (cell.lastAt > lastAt[id])
+        {
+          lastAt[id] = cell.lastAt;
+          total.last = cell.last;
+        }
+        if (cell.histogram)
+        {
+          total.histogram.merge(*cell.histogram);
+        }
+      }
+    }
+
+    // Merged metrics come last, their gauge value only counts when no thread set the gauge
+    ProfilerLock lock(mtx);
+    for (std::uint32_t id = 0; id < mergedMetrics.size() && id < result.size(); ++id)
+    {
+      const MetricCell &cell = mergedMetrics[id];
+      if (!cell.count)
+      {
+        continue;
+      }
+      MetricSnapshot &total = result[id];
+      if (lastAt[id] < 0)
+      {
+        total.last = cell.last;
+      }
+      total.min = total.count && total.min < cell.min ? total.min : cell.min;
+      total.max = total.count && total.max > cell.max ? total.max : cell.max;
+      total.count += cell.count;
+      total.sum += cell.sum;
+      if (cell.histogram)
+      {
+        total.histogram.merge(*cell.histogram);
+      }
+    }
+    return result;
+  }
+
+  /// @brief Calls callback on the thread that closed the scope, each time a RECORD_CALL_BUDGET()
+  /// scope overruns its budget. Replaces a deferred callback
+  void setBudgetCallback(std::function<void(const BudgetViolation &)> callback)
+  {
+    budgetWorker.stop();
+    ProfilerLock lock(mtx);
+    budgetCallback = std::make_shared<std::function<void(const BudgetViolation &)>>(std::move(callback));
+    budgetDeferred = false;
+  }
+
+  /// @brief Queues the overruns and calls callback for them from a background thread every
+  /// interval, so the overrunning thread only takes the profiler lock. Overruns past maxQueued
+  /// are counted in the report but not delivered
+  bool setDeferredBudgetCallback(std::function<void(const BudgetViolation &)> callback,
+                                 std::chrono::milliseconds interval = std::chrono::milliseconds(100),
+                                 std::size_t maxQueued = 4096)
+  {
+    budgetWorker.stop();
+    {
+      ProfilerLock lock(mtx);
+      budgetCallback = std::make_shared<std::function<void(const BudgetViolation &)>>(std::move(callback));
+      budgetDeferred = true;
+      budgetQueueLimit = maxQueued;
+    }
+    return budgetWorker.start(interval, [this]() { deliverBudgetViolations(); });
+  }
+
+  /// @brief Stops calling back, a deferred callback gets the overruns still queued first
+  void clearBudgetCallback()
+  {
+    budgetWorker.stop();
+    ProfilerLock lock(mtx);
+    budgetCallback.reset();
+    budgetDeferred = false;
+  }
+
+  /// @brief Id of the site named at runtime, interned in the registry on the first use of the name
+  /// and then found in the calling thread's cache without taking the registry lock
+  std::uint32_t dynamicSite(const std::string &name)
+  {
+    ThreadState &state = localState();
+    auto it = state.dynamicSites.find(name);
+    if (it != state.dynamicSites.end())
+    {
+      return it->second;
+    }
+    std::uint32_t site = SiteRegistry::getInstance().registerDynamicSite(name);
+    state.dynamicSites.emplace(name, site);
+    return site;
+  }
+
+  /// @brief Sizes the label tables of RECORD_CALL_LABEL() sites created from now on: the number of
+  /// labels tracked exactly and the number of heavy hitter slots shared by the later labels
+  void setLabelLimits(std::size_t exactLabels, std::size_t heavyHitters)
+  {
+    ProfilerLock lock(labelMtx);
+    labelLimit = exactLabels;
+    labelSketchSize = heavyHitters;
+  }
+
+  /// @brief Number of values of a tag key that get a group of their own per site. Calls with
+  /// later values are counted in one "(other values)" group per site and key
+  void setTagValueLimit(std::size_t values)
+  {
+    ProfilerLock lock(tagMtx);
+    tagValueLimit = values;
+  }
+
+  /// @brief Per-label totals of a RECORD_CALL_LABEL() site, heaviest first, then the overflow bucket
+  std::vector<LabelStats> labelStats(std::uint32_t site) const
+  {
+    ProfilerLock lock(labelMtx);
+    auto it = labelTables.find(site);
+    return it == labelTables.end() ? std::vector<LabelStats>() : it->second.stats();
+  }
+
+  /// @brief Tracks calls of the sites whose qualified name, function name or identifier equals
+  /// function against the objective, including sites registered later. A site matching several
+  /// objectives follows the one set last, which restarts its counts
+  void setLatencyObjective(const std::string &function, const LatencyObjective &objective)
+  {
+    ProfilerLock lock(mtx);
+    objectives.emplace_back(function, objective);
+    objectivesSet.store(true, std::memory_order_relaxed);
+    std::fill(objectiveSlots.begin(), objectiveSlots.end(), static_cast<std::int32_t>(kUnresolvedObjective));
+  }
+
+  void setLatencyObjective(const std::string &function, std::chrono::microseconds threshold, double target)
+  {
+    LatencyObjective objective;
+    objective.threshold = threshold;
+    objective.target = target;
+    setLatencyObjective(function, objective);
+  }
+
+  /// @brief Status of every site with an objective, the highest burn rate in the shortest window first
+  std::vector<ObjectiveStatus> objectiveStatus() const
+  {
+    std::vector<ObjectiveStatus> result;
+    long long slot = objectiveSlot(Clock::now());
+    ProfilerLock lock(mtx);
+    for (const ObjectiveTracker &tracker : objectiveTrackers)
+    {
+      ObjectiveStatus status;
+      status.site = tracker.site;
+      status.objective = objectives[tracker.objective].second;
+      status.good = tracker.good;
+      status.bad = tracker.bad;
+      double allowed = 1.0 - status.objective.target;
+      for (const std::chrono::seconds &window : status.objective.windows)
+      {
+        long long slots = (window.count() + kObjectiveSlotSeconds - 1) / kObjectiveSlotSeconds;
+        ObjectiveWindow summary{window, 0, 0, 0.0};
+        for (const typename ObjectiveTracker::Slot &bucket : tracker.slots)
+        {
+          if (bucket.slot > slot - slots && bucket.slot <= slot)
+          {
+            summary.good += bucket.good;
+            summary.bad += bucket.bad;
+          }
+        }
+        std::uint64_t calls = summary.good + summary.bad;
+        if (calls && allowed > 0.0)
+        {
+          summary.burnRate = static_cast<double>(summary.bad) / static_cast<double>(calls) / allowed;
+        }
+        status.windows.push_back(summary);
+      }
+      status.worst = tracker.worst;
+      std::sort(status.worst.begin(), status.worst.end(),
+                [](const SlowCall &a, const SlowCall &b) { return a.duration > b.duration; });
+      result.push_back(std::move(status));
+    }
+    std::sort(result.begin(), result.end(),
+              [](const ObjectiveStatus &a, const ObjectiveStatus &b)
+              {
+                double burnA = a.windows.empty() ? 0.0 : a.windows[0].burnRate;
+                double burnB = b.windows.empty() ? 0.0 : b.windows[0].burnRate;
+                return burnA > burnB;
+              });
+    return result;
+  }
+
+  /// @brief Per-iteration time distribution of a RECORD_LOOP() site, empty for other sites
+  LatencyHistogram iterationHistogram(std::uint32_t site) const
+  {
+    ProfilerLock lock(mtx);
+    auto it = iterationHistograms.find(site);
+    return it == iterationHistograms.end() ? LatencyHistogram() : *it->second;
+  }
+
+  /// @brief Durations of the site's calls, empty unless the policy keeps StatisticsMode::Histogram
+  LatencyHistogram siteHistogram(std::uint32_t site) const
+  {
+    LatencyHistogram histogram;
+    {
+      ProfilerLock lock(mtx);
+      if (site < mergedSites.size() && mergedSites[site].histogram)
+      {
+        histogram.merge(*mergedSites[site].histogram);
+      }
+    }
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      if (site < state->sites.size() && state->sites[site].histogram)
+      {
+        histogram.merge(*state->sites[site].histogram);
+      }
+    }
+    return histogram;
+  }
+
+  /// @brief Enables or disables recording of scope open/close events used by the timeline exports
+  void setTracingEnabled(bool enabled)
+  {
+    tracing.store(enabled, std::memory_order_relaxed);
+  }
+
+  /// @brief Maximum number of events kept per thread, past it the oldest ones are overwritten.
+  /// A ring that has already wrapped keeps its size
+  void setTraceCapacity(std::size_t events)
+  {
+    traceCapacity.store(events, std::memory_order_relaxed);
+  }
+
+  /// @brief Number of per-thread states, the most threads that recorded at the same time. The
+  /// state of an exited thread is reused by the next thread that starts
+  std::size_t threadCount() const
+  {
+    ProfilerLock lock(mtx);
+    return threads.size();
+  }
+
+  /// @brief Aggregated totals per rollup group, heaviest first. The duration of a group counts
+  /// only the outermost of nested scopes within the group, self durations are summed
+  std::vector<std::pair<std::string, ProfileInfo>> rollup(RollupLevel level = RollupLevel::Site) const
+  {
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::vector<std::pair<std::string, ProfileInfo>> entries;
+    std::vector<SiteCell> sites = siteTotals(false);
+    std::size_t levelIndex = static_cast<std::size_t>(level);
+    std::unordered_map<std::string, std::size_t> groups;
+    for (std::uint32_t site = 0; site < sites.size(); ++site)
+    {
+      const ProfileInfo &info = sites[site].info;
+      if (!info.count)
+      {
+        continue;
+      }
+      std::string name = SiteRegistry::groupName(registry.site(site), level);
+      auto it = groups.find(name);
+      if (it == groups.end())
+      {
+        it = groups.emplace(name, entries.size()).first;
+        entries.emplace_back(name, ProfileInfo());
+      }
+      ProfileInfo &total = entries[it->second].second;
+      total.count += info.count;
+      total.duration += sites[site].outermost[levelIndex];
+      total.selfDuration += info.selfDuration;
+      total.recursiveCount += info.recursiveCount;
+      total.budgetViolations += info.budgetViolations;
+      if (info.maxDepth > total.maxDepth)
+      {
+        total.maxDepth = info.maxDepth;
+      }
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const std::pair<std::string, ProfileInfo> &a, const std::pair<std::string, ProfileInfo> &b)
+              {
+                if (a.second.duration != b.second.duration)
+                  return a.second.duration > b.second.duration;
+                return a.second.count > b.second.count;
+              });
+    return entries;
+  }
+
+  void dumpTextReport(const std::string &filename, RollupLevel level = RollupLevel::Site) const
+  {
+    std::vector<std::pair<std::string, ProfileInfo>> entries = rollup(level);
+    std::vector<MetricSnapshot> snapshots = metrics();
+    if (entries.empty() && snapshots.empty())
+    {
+      return;
+    }
+
+    std::unordered_map<std::string, LatencyHistogram> loops;
+    std::unordered_map<std::string, LatencyHistogram> latencies;
+    std::unordered_map<std::string, std::vector<LabelStats>> labels;
+    if (level == RollupLevel::Site)
+    {
+      std::vector<SiteCell> sites = siteTotals(Policy::kStatistics == StatisticsMode::Histogram);
+      for (std::uint32_t site = 0; site < sites.size(); ++site)
+      {
+        if (sites[site].histogram)
+        {
+          latencies.emplace(SiteRegistry::getInstance().site(site).identifier, *sites[site].histogram);
+        }
+      }
+      ProfilerLock lock(mtx);
+      for (const auto &loop : iterationHistograms)
+      {
+        loops.emplace(SiteRegistry::getInstance().site(loop.first).identifier, *loop.second);
+      }
+      ProfilerLock labelLock(labelMtx);
+      for (const auto &table : labelTables)
+      {
+        labels.emplace(SiteRegistry::getInstance().site(table.first).identifier, table.second.stats());
+      }
+    }
+
+    std::ofstream outFile(filename);
+    if (!outFile.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return;
+    }
+
+    // Write out the sorted data
+    outFile << "===== Profiling Report =====\n";
+    long long resolution = ClockTraits<Clock>::resolution().count();
+    bool coarse = kTimed && resolution >= 1000;
+    if (kTimed)
+    {
+      const ClockQuality &quality = clockQuality();
+      outFile << "Clock: " << quality.source << ", resolution " << quality.resolution << " ns, " << quality.readCost
+              << " ns per read, ";
+      if (quality.backwardSteps)
+      {
+        outFile << "NOT monotonic (" << quality.backwardSteps << " backward steps in " << quality.reads << " reads)";
+      }
+      else
+      {
+        outFile << "monotonic over " << quality.reads << " reads";
+      }
+      if (quality.skewMeasured)
+      {
+        outFile << ", cross-CPU skew up to " << quality.maxSkew << " ns";
+      }
+      if (coarse)
+      {
+        outFile << ", ticks every " << resolution / 1000 << " us: sites marked ~ average less than one tick per call";
+      }
+      outFile << "\n";
+    }
+    double cyclesPerNs = Policy::kBenchmark ? ClockTraits<Clock>::cyclesPerNs() : 0;
+    if (Policy::kBenchmark)
+    {
+      outFile << "Benchmark timing: " << baseline << " ns baseline subtracted per call";
+      if (cyclesPerNs > 0)
+      {
+        outFile << ", " << cyclesPerNs << " cycles per ns";
+      }
+      outFile << "\n";
+    }
+    for (const auto &entry : entries)
+    {
+      bool belowResolution = coarse && entry.second.duration < resolution * static_cast<long long>(entry.second.count);
+      outFile << (belowResolution ? "~" : "") << entry.first << ": " << entry.second.duration / 1000 << " us, "
+              << entry.second.selfDuration / 1000 << " us self, " << entry.second.count << " calls";
+      if (entry.second.recursiveCount)
+      {
+        outFile << " (" << entry.second.recursiveCount << " recursive, max depth " << entry.second.maxDepth << ")";
+      }
+      if (entry.second.budgetViolations)
+      {
+        outFile << ", " << entry.second.budgetViolations << " over budget";
+      }
+      if (Policy::kBenchmark && entry.second.count)
+      {
+        double perCall = static_cast<double>(entry.second.duration) / entry.second.count;
+        outFile << ", " << perCall << " ns";
+        if (cyclesPerNs > 0)
+        {
+          outFile << " (" << perCall * cyclesPerNs << " cycles)";
+        }
+        outFile << " per call";
+      }
+      outFile << "\n";
+      auto latency = latencies.find(entry.first);
+      if (latency != latencies.end())
+      {
+        const LatencyHistogram &histogram = latency->second;
+        outFile << "    calls: p50 " << histogram.percentile(0.5) << " ns, p90 " << histogram.percentile(0.9)
+                << " ns, p99 " << histogram.percentile(0.99) << " ns, max " << histogram.max() << " ns\n";
+      }
+      auto loop = loops.find(entry.first);
+      if (loop != loops.end())
+      {
+        const LatencyHistogram &histogram = loop->second;
+        outFile << "    iterations: p50 " << histogram.percentile(0.5) << " ns, p90 " << histogram.percentile(0.9)
+                << " ns, p99 " << histogram.percentile(0.99) << " ns, max " << histogram.max() << " ns\n";
+      }
+      auto labelled = labels.find(entry.first);
+      if (labelled != labels.end())
+      {
+        for (const LabelStats &label : labelled->second)
+        {
+          if (label.overflow)
+          {
+            outFile << "    (other labels)";
+          }
+          else
+          {
+            outFile << "    [" << (label.exact ? "" : "~") << label.label << "]";
+          }
+          outFile << ": " << label.info.duration / 1000 << " us, " << label.info.selfDuration / 1000 << " us self, "
+                  << label.info.count << " calls";
+          if (label.error)
+          {
+            outFile << " (up to " << label.error << " more before tracking)";
+          }
+          outFile << "\n";
+        }
+      }
+    }
+
+    if (!snapshots.empty())
+    {
+      outFile << "===== Metrics =====\n";
+    }
+    for (const MetricSnapshot &metric : snapshots)
+    {
+      if (!metric.count)
+      {
+        continue;
+      }
+      outFile << metric.name << ": ";
+      switch (metric.kind)
+      {
+      case MetricKind::Counter:
+        outFile << metric.sum << " total, " << metric.count << " updates\n";
+        break;
+      case MetricKind::Gauge:
+        outFile << metric.last << " (min " << metric.min << ", max " << metric.max << ")\n";
+        break;
+      case MetricKind::Value:
+        outFile << metric.count << " samples, avg " << metric.sum / static_cast<double>(metric.count) << ", min "
+                << metric.min << ", p50 " << metric.histogram.percentile(0.5) << ", p99 "
+                << metric.histogram.percentile(0.99) << ", max " << metric.max << "\n";
+        break;
+      }
+    }
+
+    outFile.close();
+  }
+
+  /// @brief Writes frame time statistics, the sites behind over-budget frames, the worst
+  /// frames with their breakdown and a timeline of the recent frames
+  void dumpFrameReport(const std::string &filename) const
+  {
+    // Copied out first, so threads closing scopes are not blocked while the file is written
+    long long budget = 0;
+    std::uint64_t overBudget = 0;
+    LatencyHistogram times;
+    std::vector<std::pair<std::uint32_t, FrameSlot>> overruns;
+    std::deque<FrameRecord> recent;
+    FrameRecord worstRecord;
+    {
+      ProfilerLock lock(mtx);
+      budget = frameBudget;
+      overBudget = overBudgetFrames;
+      times = frameTimes;
+      overruns.assign(overrunSites.begin(), overrunSites.end());
+      recent = recentFramesRing;
+      worstRecord = worstFrame;
+    }
+
+    std::ofstream outFile(filename);
+    if (!outFile.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return;
+    }
+
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::uint64_t frames = times.count();
+    outFile << "===== Frame Report =====\n";
+    outFile << frames << " frames, budget " << budget / 1000 << " us, " << overBudget << " over budget\n";
+    if (!frames)
+    {
+      return;
+    }
+    outFile << "frame time: p50 " << times.percentile(0.5) / 1000 << " us, p90 " << times.percentile(0.9) / 1000
+            << " us, p99 " << times.percentile(0.99) / 1000 << " us, max " << times.max() / 1000 << " us\n";
+
+    if (!overruns.empty())
+    {
+      std::sort(overruns.begin(), overruns.end(),
+                [](const std::pair<std::uint32_t, FrameSlot> &a, const std::pair<std::uint32_t, FrameSlot> &b)
+                { return a.second.selfDuration > b.second.selfDuration; });
+      outFile << "\nSelf time in over-budget frames:\n";
+      for (const auto &overrun : overruns)
+      {
+        outFile << "  " << registry.site(overrun.first).identifier << ": " << overrun.second.selfDuration / 1000
+                << " us in " << overrun.second.frame << " frames, " << overrun.second.count << " calls\n";
+      }
+    }
+
+    std::vector<const FrameRecord *> worst;
+    for (const FrameRecord &frame : recent)
+    {
+      worst.push_back(&frame);
+    }
+    std::sort(worst.begin(), worst.end(),
+              [](const FrameRecord *a, const FrameRecord *b) { return a->duration > b->duration; });
+    if (worst.size() > 5)
+    {
+      worst.resize(5);
+    }
+    if (worst.empty() || worst[0]->index != worstRecord.index)
+    {
+      worst.insert(worst.begin(), &worstRecord);
+    }
+    outFile << "\nWorst frames:\n";
+    for (const FrameRecord *frame : worst)
+    {
+      outFile << "  #" << frame->index << " at " << frame->start / 1000000 << " ms: " << frame->duration / 1000 << " us"
+              << (frame->overBudget ? " (over budget)" : "") << "\n";
+      for (std::size_t i = 0; i < frame->sites.size() && i < 5; ++i)
+      {
+        const FrameSiteTime &site = frame->sites[i];
+        outFile << "    " << registry.site(site.site).identifier << ": " << site.selfDuration / 1000 << " us self, "
+                << site.count << " calls\n";
+      }
+    }
+
+    outFile << "\nTimeline:\n";
+    for (const FrameRecord &frame : recent)
+    {
+      outFile << "  #" << frame.index << " " << frame.start / 1000000 << " ms " << frame.duration / 1000 << " us"
+              << (frame.overBudget ? " !" : "");
+      if (!frame.sites.empty())
+      {
+        outFile << " " << registry.site(frame.sites[0].site).identifier;
+      }
+      outFile << "\n";
+    }
+  }
+
+  /// @brief Writes the compliance, burn rates and slowest calls of the sites with an objective
+  void dumpObjectiveReport(const std::string &filename) const
+  {
+    std::vector<ObjectiveStatus> statuses = objectiveStatus();
+    std::ofstream outFile(filename);
+    if (!outFile.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return;
+    }
+
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    outFile << "===== Latency Objectives =====\n";
+    for (const ObjectiveStatus &status : statuses)
+    {
+      std::uint64_t calls = status.good + status.bad;
+      outFile << registry.site(status.site).identifier << ": " << status.objective.target * 100 << "% under "
+              << status.objective.threshold.count() << " us, " << status.good << "/" << calls << " good";
+      if (calls)
+      {
+        outFile << " (" << 100.0 * static_cast<double>(status.good) / static_cast<double>(calls) << "%)";
+      }
+      outFile << "\n";
+      for (const ObjectiveWindow &window : status.windows)
+      {
+        outFile << "    last " << window.window.count() << " s: " << window.bad << " bad of " << window.good + window.bad
+                << ", burn rate " << window.burnRate << "\n";
+      }
+      if (!status.worst.empty())
+      {
+        outFile << "    slowest:";
+        for (const SlowCall &call : status.worst)
+        {
+          outFile << " " << call.duration / 1000 << " us at " << call.at / 1000000 << " ms;";
+        }
+        outFile << "\n";
+      }
+    }
+  }
+
+  /// @brief Writes the calls annotated with the tag key, split by the tag value
+  void dumpTagReport(const std::string &filename, const std::string &key, RollupLevel level = RollupLevel::Site) const
+  {
+    std::vector<std::pair<std::string, ProfileInfo>> entries = rollupByTag(key, level);
+    std::ofstream outFile(filename);
+    if (!outFile.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return;
+    }
+
+    outFile << "===== Tag Report: " << key << " =====\n";
+    for (const auto &entry : entries)
+    {
+      outFile << entry.first << ": " << entry.second.duration / 1000 << " us, " << entry.second.selfDuration / 1000
+              << " us self, " << entry.second.count << " calls\n";
+    }
+  }
+
+  /// @brief Writes the recorded events in speedscope's file format (https://www.speedscope.app),
+  /// one evented profile per thread. Events are copied out in chunks and streamed to the file,
+  /// so recording threads are only blocked for the duration of a chunk copy
+  void dumpSpeedscope(const std::string &filename) const
+  {
+    std::vector<ThreadState *> traces = threadStates();
+
+    // Snapshot the event counts before the frame table, so every site referenced
+    // by the exported events is already registered
+    std::vector<std::uint64_t> limits;
+    for (ThreadState *trace : traces)
+    {
+      ProfilerLock lock(trace->mtx);
+      limits.push_back(trace->eventCount);
+    }
+
+#if defined(CHRONOSCOPE_SAMPLING)
+    // Sampled profiles stack the active RECORD_CALL sites over the native frames that ran
+    // below the innermost one. Native frames follow the sites in the frame table
+    drainSamples();
+    std::vector<std::size_t> sampleLimits;
+    for (ThreadState *trace : traces)
+    {
+      ProfilerLock lock(trace->mtx);
+      sampleLimits.push_back(trace->samples.size());
+    }
+    std::vector<std::string> nativeFrames;
+    std::unordered_map<std::string, std::uint32_t> nativeFrameIndex;
+    auto sampleStack = [&](const RecordedSample &sample, std::vector<std::uint32_t> &stack, std::size_t siteCount)
+    {
+      stack.assign(sample.scopes.begin(), sample.scopes.end());
+      for (std::size_t i = calleeFrameCount(sample); i-- > 0;)
+      {
+        const std::string &name = symbolName(sample.frames[i]);
+        auto it = nativeFrameIndex.find(name);
+        if (it == nativeFrameIndex.end())
+        {
+          it = nativeFrameIndex.emplace(name, static_cast<std::uint32_t>(nativeFrames.size())).first;
+          nativeFrames.push_back(name);
+        }
+        stack.push_back(static_cast<std::uint32_t>(siteCount + it->second));
+      }
+    };
+    auto forEachSample = [&](std::size_t t, const std::function<void(const RecordedSample &)> &visit)
+    {
+      const std::size_t chunkSize = 1024;
+      std::vector<RecordedSample> chunk;
+      for (std::size_t offset = 0; offset < sampleLimits[t]; offset += chunkSize)
+      {
+        {
+          ProfilerLock lock(traces[t]->mtx);
+          std::size_t end = (std::min)(sampleLimits[t], offset + chunkSize);
+          chunk.assign(traces[t]->samples.begin() + offset, traces[t]->samples.begin() + end);
+        }
+        for (const RecordedSample &sample : chunk)
+        {
+          visit(sample);
+        }
+      }
+    };
+#endif
+
+    std::ofstream outFile(filename);
+    if (!outFile.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return;
+    }
+
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::size_t frameCount = registry.size();
+
+    outFile << "{\"$schema\":\"https://www.speedscope.app/file-format-schema.json\",\"shared\":{\"frames\":[";
+    for (std::uint32_t site = 0; site < frameCount; ++site)
+    {
+      const SiteInfo &info = registry.site(site);
+      outFile << (site ? "," : "") << "{\"name\":";
+      writeJsonString(outFile, info.displayName);
+      outFile << ",\"file\":";
+      writeJsonString(outFile, info.fileName);
+      outFile << ",\"line\":" << info.lineNo << "}";
+    }
+#if defined(CHRONOSCOPE_SAMPLING)
+    std::vector<std::uint32_t> stack;
+    for (std::size_t t = 0; t < traces.size(); ++t)
+    {
+      forEachSample(t, [&](const RecordedSample &sample) { sampleStack(sample, stack, frameCount); });
+    }
+    for (const std::string &name : nativeFrames)
+    {
+      outFile << (frameCount ? "," : "") << "{\"name\":";
+      writeJsonString(outFile, name);
+      outFile << "}";
+      frameCount++;
+    }
+    frameCount -= nativeFrames.size();
+#endif
+    outFile << "]},\"profiles\":[";
+
+    const std::size_t chunkSize = 4096;
+    std::vector<TraceEvent> chunk;
+    bool firstProfile = true;
+    for (std::size_t t = 0; t < traces.size(); ++t)
+    {
+      ThreadState *trace = traces[t];
+      std::uint64_t limit = limits[t];
+      if (!limit)
+      {
+        continue;
+      }
+
+      // Events the ring overwrites while the export runs are skipped. A close or tag whose open
+      // was overwritten finds no matching open frame and is dropped like any unmatched exit
+      std::uint64_t first = 0;
+      long long startValue = 0;
+      long long endValue = 0;
+      {
+        ProfilerLock lock(trace->mtx);
+        first = trace->eventCount - trace->events.size();
+        startValue = trace->events[first % trace->events.size()].at;
+        std::uint64_t last = limit - 1;
+        while (last > first && trace->events[last % trace->events.size()].type == TraceEventType::Tag)
+        {
+          last--;
+        }
+        endValue = trace->events[last % trace->events.size()].at;
+      }
+
+      outFile << (firstProfile ? "" : ",") << "{\"type\":\"evented\",\"name\":\"Thread " << trace->threadIndex
+              << "\",\"unit\":\"nanoseconds\",\"startValue\":" << startValue << ",\"endValue\":" << endValue
+              << ",\"events\":[";
+      firstProfile = false;
+
+      // Tags of the open scopes go out as args of their close events
+      std::vector<std::uint32_t> openFrames;
+      std::vector<std::string> openTags;
+      bool firstEvent = true;
+      for (std::uint64_t offset = first; offset < limit; offset += chunkSize)
+      {
+        {
+          ProfilerLock lock(trace->mtx);
+          std::uint64_t end = (std::min)(limit, offset + static_cast<std::uint64_t>(chunkSize));
+          chunk.clear();
+          for (std::uint64_t n = (std::max)(offset, trace->eventCount - trace->events.size()); n < end; ++n)
+          {
+            chunk.push_back(trace->events[n % trace->events.size()]);
+          }
+        }
+
+        for (const TraceEvent &event : chunk)
+        {
+          std::string args;
+          if (event.type == TraceEventType::Tag)
+          {
+            if (!openTags.empty())
+            {
+              std::stringstream ss;
+              ss << (openTags.back().empty() ? "" : ",");
+              writeJsonString(ss, SiteRegistry::getInstance().internedString(event.site));
+              ss << ":";
+              writeTagJson(ss, ScopeTag{event.site, event.tagType, static_cast<std::uint64_t>(event.at)});
+              openTags.back() += ss.str();
+            }
+            continue;
+          }
+          if (event.type == TraceEventType::Open)
+          {
+            openFrames.push_back(event.site);
+            openTags.emplace_back();
+          }
+          else if (openFrames.empty() || openFrames.back() != event.site)
+          {
+            continue;
+          }
+          else
+          {
+            openFrames.pop_back();
+            args.swap(openTags.back());
+            openTags.pop_back();
+          }
+          outFile << (firstEvent ? "" : ",") << "{\"type\":\"" << (event.type == TraceEventType::Open ? "O" : "C")
+                  << "\",\"frame\":" << event.site << ",\"at\":" << event.at;
+          if (!args.empty())
+          {
+            outFile << ",\"args\":{" << args << "}";
+          }
+          outFile << "}";
+          firstEvent = false;
+        }
+      }
+
+      // Scopes still running at dump time are closed at the end of the profile
+      while (!openFrames.empty())
+      {
+        outFile << (firstEvent ? "" : ",") << "{\"type\":\"C\",\"frame\":" << openFrames.back() << ",\"at\":" << endValue << "}";
+        openFrames.pop_back();
+        firstEvent = false;
+      }
+      outFile << "]}";
+    }
+
+#if defined(CHRONOSCOPE_SAMPLING)
+    long long weight = samplingInterval.load(std::memory_order_relaxed);
+    for (std::size_t t = 0; t < traces.size(); ++t)
+    {
+      if (!sampleLimits[t])
+      {
+        continue;
+      }
+
+      long long startValue = 0;
+      long long endValue = 0;
+      {
+        ProfilerLock lock(traces[t]->mtx);
+        startValue = traces[t]->samples.front().at;
+        endValue = traces[t]->samples[sampleLimits[t] - 1].at;
+      }
+
+      outFile << (firstProfile ? "" : ",") << "{\"type\":\"sampled\",\"name\":\"Thread " << traces[t]->threadIndex
+              << " (samples)\",\"unit\":\"nanoseconds\",\"startValue\":" << startValue << ",\"endValue\":" << endValue
+              << ",\"samples\":[";
+      firstProfile = false;
+      bool firstSample = true;
+      forEachSample(t,
+                    [&](const RecordedSample &sample)
+                    {
+                      sampleStack(sample, stack, frameCount);
+                      outFile << (firstSample ? "[" : ",[");
+                      for (std::size_t i = 0; i < stack.size(); ++i)
+                      {
+                        outFile << (i ? "," : "") << stack[i];
+                      }
+                      outFile << "]";
+                      firstSample = false;
+                    });
+      outFile << "],\"weights\":[";
+      for (std::size_t i = 0; i < sampleLimits[t]; ++i)
+      {
+        outFile << (i ? "," : "") << weight;
+      }
+      outFile << "]}";
+    }
+#endif
+
+    outFile << "],\"name\":\"ChronoScope\",\"activeProfileIndex\":0,\"exporter\":\"ChronoScope\"}\n";
+    outFile.close();
+  }
+
+  /// @brief Starts a background thread that appends finished spans to filename as OTLP/JSON lines,
+  /// one ExportTraceServiceRequest per line, as read by the collector's otlpjsonfile receiver
+  bool startOtlpExport(const std::string &filename, const OtlpExportOptions &options = OtlpExportOptions())
+  {
+    ProfilerLock exportLock(exportControlMtx);
+    if (otlpWorker.running())
+    {
+      return false;
+    }
+
+    std::shared_ptr<std::ofstream> outFile(new std::ofstream(filename, std::ios::app));
+    if (!outFile->is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return false;
+    }
+
+    otlpOptions = options;
+    spanQueueLimit.store(options.maxQueuedSpans, std::memory_order_relaxed);
+    exportingSpans.store(true, std::memory_order_relaxed);
+    return otlpWorker.start(options.flushInterval, [this, outFile]() { exportSpans(*outFile); });
+  }
+
+  /// @brief Stops the exporter thread after writing out the spans finished so far
+  void stopOtlpExport()
+  {
+    ProfilerLock exportLock(exportControlMtx);
+    exportingSpans.store(false, std::memory_order_relaxed);
+    otlpWorker.stop();
+  }
+
+  /// @brief Starts a background thread that sends the per-site call counts and times
+  /// accumulated during each interval to a StatsD agent over UDP
+  bool startStatsdExport(const StatsdExportOptions &options = StatsdExportOptions())
+  {
+    ProfilerLock exportLock(exportControlMtx);
+    if (statsdWorker.running())
+    {
+      return false;
+    }
+
+    std::shared_ptr<UdpSocket> socket(new UdpSocket());
+    if (!socket->open(options.host, options.port))
+    {
+      std::cerr << "Failed to open StatsD socket: " << options.host << ":" << options.port << std::endl;
+      return false;
+    }
+
+    // Only what is recorded from now on is sent
+    std::shared_ptr<std::uint64_t> generation(new std::uint64_t(resetGeneration.load(std::memory_order_relaxed)));
+    std::shared_ptr<std::vector<ProfileInfo>> lastSent(new std::vector<ProfileInfo>());
+    for (const SiteCell &cell : siteTotals(false))
+    {
+      lastSent->push_back(cell.info);
+    }
+    std::shared_ptr<std::vector<MetricSnapshot>> lastMetrics(new std::vector<MetricSnapshot>(metrics()));
+    return statsdWorker.start(options.interval, [this, options, socket, generation, lastSent, lastMetrics]()
+                              { exportStatsd(options, *socket, *generation, *lastSent, *lastMetrics); });
+  }
+
+  /// @brief Stops the StatsD exporter after sending the last interval
+  void stopStatsdExport()
+  {
+    ProfilerLock exportLock(exportControlMtx);
+    statsdWorker.stop();
+  }
+
+  /// @brief StatsD lines skipped because they did not fit in StatsdExportOptions::maxPacketSize
+  std::uint64_t statsdOversizeLines() const
+  {
+    return statsdOversize.load(std::memory_order_relaxed);
+  }
+
+#if defined(CHRONOSCOPE_SYMBOLS)
+  /// @brief Limits -finstrument-functions profiling to functions whose demangled name contains one
+  /// of the include patterns (any function if empty) and none of the exclude patterns. A function
+  /// is checked once, when it is first called, so the filter should be set before the profiled code runs
+  void setFunctionFilter(const std::vector<std::string> &include, const std::vector<std::string> &exclude)
+  {
+    ProfilerLock lock(mtx);
+    functionInclude = include;
+    functionExclude = exclude;
+  }
+
+  /// @brief Called by __cyg_profile_func_enter, opens a scope for the function like a Timer would
+  void functionEnter(void *function)
+  {
+    if (threadExiting())
+    {
+      return;
+    }
+    ThreadState &state = localState();
+    if (!state.hooks)
+    {
+      state.hooks.reset(new FunctionHookState());
+    }
+    FunctionHookState &hooks = *state.hooks;
+    std::uint32_t depth = hooks.depth++;
+    if (depth >= sizeof(hooks.frames) / sizeof(hooks.frames[0]))
+    {
+      return;
+    }
+
+    std::uint32_t site = SiteRegistry::kNoSite;
+    auto it = hooks.sites.find(function);
+    if (it != hooks.sites.end())
+    {
+      site = it->second;
+    }
+    else
+    {
+      site = functionSite(function);
+      hooks.sites.emplace(function, site);
+    }
+
+    FunctionHookState::Frame &frame = hooks.frames[depth];
+    frame.function = function;
+    frame.site = site;
+    if (site != SiteRegistry::kNoSite)
+    {
+      TimePoint start = scopeTime();
+      frame.start = start.time_since_epoch().count();
+      enterScope(state, site, start, false);
+    }
+  }
+
+  /// @brief Called by __cyg_profile_func_exit, closes the scope opened by functionEnter. Hooks
+  /// are skipped while a profiler lock is held, so a function may enter without exiting or the
+  /// reverse: an exit that matches no open frame is dropped, and frames left open above the
+  /// matching one are closed with it
+  void functionExit(void *function)
+  {
+    if (threadExiting())
+    {
+      return;
+    }
+    ThreadState &state = localState();
+    if (!state.hooks || !state.hooks->depth)
+    {
+      return;
+    }
+    FunctionHookState &hooks = *state.hooks;
+    const std::uint32_t capacity = sizeof(hooks.frames) / sizeof(hooks.frames[0]);
+    if (hooks.depth > capacity)
+    {
+      // Frames past the capacity were not kept and cannot be matched
+      hooks.depth--;
+      return;
+    }
+
+    std::uint32_t match = hooks.depth;
+    while (match && hooks.frames[match - 1].function != function)
+    {
+      match--;
+    }
+    if (!match)
+    {
+      return;
+    }
+    TimePoint end = scopeTime();
+    while (hooks.depth >= match)
+    {
+      const FunctionHookState::Frame &frame = hooks.frames[--hooks.depth];
+      if (frame.site != SiteRegistry::kNoSite)
+      {
+        exitScope(state, frame.site, TimePoint(Duration(frame.start)), end);
+      }
+    }
+  }
+#endif
+
+#if defined(CHRONOSCOPE_SAMPLING)
+  /// @brief Starts statistical sampling of thread CPU time. Each thread arms its own SIGPROF
+  /// timer on its first instrumented scope after this call; samples hold the native stack and
+  /// the RECORD_CALL scopes active at that moment. Symbol names need -rdynamic for executables
+  bool startSampling(std::chrono::microseconds interval = std::chrono::microseconds(1000))
+  {
+    ProfilerLock exportLock(exportControlMtx);
+    if (samplingWorker.running())
+    {
+      return false;
+    }
+
+    installSampleHandler();
+    samplingInterval.store(std::chrono::duration_cast<std::chrono::nanoseconds>(interval).count(), std::memory_order_relaxed);
+    samplingActive.store(true, std::memory_order_relaxed);
+    samplingGeneration.fetch_add(1, std::memory_order_relaxed);
+    armSampling(localState());
+    return samplingWorker.start(std::chrono::milliseconds(100), [this]() { drainSamples(); });
+  }
+
+  /// @brief Disarms the sampling timers of all threads, the samples taken so far are kept
+  void stopSampling()
+  {
+    ProfilerLock exportLock(exportControlMtx);
+    samplingActive.store(false, std::memory_order_relaxed);
+    samplingGeneration.fetch_add(1, std::memory_order_relaxed);
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      disarmSampling(*state);
+    }
+    samplingWorker.stop();
+  }
+
+  /// @brief Writes, for every instrumented site, the uninstrumented functions that
+  /// the samples taken inside it were spending CPU time in
+  void dumpSampleReport(const std::string &filename) const
+  {
+    drainSamples();
+    std::vector<RecordedSample> samples;
+    std::size_t dropped = 0;
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      samples.insert(samples.end(), state->samples.begin(), state->samples.end());
+      if (state->sampleRing)
+      {
+        dropped += state->sampleRing->dropped.load(std::memory_order_relaxed);
+      }
+    }
+
+    if (samples.empty())
+    {
+      return;
+    }
+
+    std::ofstream outFile(filename);
+    if (!outFile.is_open())
+    {
+      std::cerr << "Failed to open file for writing: " << filename << std::endl;
+      return;
+    }
+
+    struct FunctionSamples
+    {
+      std::size_t self = 0;
+      std::size_t inclusive = 0;
+    };
+    struct SiteSamples
+    {
+      std::size_t total = 0;
+      std::size_t inScope = 0;
+      std::unordered_map<std::string, FunctionSamples> functions;
+    };
+
+    std::unordered_map<std::uint32_t, SiteSamples> sites;
+    for (const RecordedSample &sample : samples)
+    {
+      std::uint32_t site = SiteRegistry::kNoSite;
+      if (!sample.scopes.empty())
+      {
+        site = sample.scopes.back();
+      }
+      SiteSamples &siteSamples = sites[site];
+      siteSamples.total++;
+
+      std::size_t callees = calleeFrameCount(sample);
+      if (!callees)
+      {
+        siteSamples.inScope++;
+        continue;
+      }
+      std::vector<std::string> seen;
+      for (std::size_t i = 0; i < callees; ++i)
+      {
+        const std::string &name = symbolName(sample.frames[i]);
+        if (!i)
+        {
+          siteSamples.functions[name].self++;
+        }
+        if (std::find(seen.begin(), seen.end(), name) == seen.end())
+        {
+          siteSamples.functions[name].inclusive++;
+          seen.push_back(name);
+        }
+      }
+    }
+
+    std::vector<std::pair<std::uint32_t, SiteSamples *>> entries;
+    for (auto &entry : sites)
+    {
+      entries.emplace_back(entry.first, &entry.second);
+    }
+    std::sort(entries.begin(), entries.end(),
+              [](const std::pair<std::uint32_t, SiteSamples *> &a, const std::pair<std::uint32_t, SiteSamples *> &b)
+              { return a.second->total > b.second->total; });
+
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    long long interval = samplingInterval.load(std::memory_order_relaxed);
+    outFile << "===== Sampling Report =====\n";
+    outFile << samples.size() << " samples of " << interval / 1000 << " us CPU time, " << dropped << " dropped\n";
+    for (const auto &entry : entries)
+    {
+      const SiteSamples &siteSamples = *entry.second;
+      outFile << "\n"
+              << (entry.first == SiteRegistry::kNoSite ? std::string("<no instrumented scope>") : registry.site(entry.first).identifier)
+              << ": " << siteSamples.total << " samples (" << 100.0 * siteSamples.total / samples.size() << "%)\n";
+      if (siteSamples.inScope)
+      {
+        outFile << "    " << siteSamples.inScope << " self, " << siteSamples.inScope << " incl: <in scope function>\n";
+      }
+
+      std::vector<std::pair<std::string, FunctionSamples>> functions(siteSamples.functions.begin(), siteSamples.functions.end());
+      std::sort(functions.begin(), functions.end(),
+                [](const std::pair<std::string, FunctionSamples> &a, const std::pair<std::string, FunctionSamples> &b)
+                {
+                  if (a.second.inclusive != b.second.inclusive)
+                    return a.second.inclusive > b.second.inclusive;
+                  return a.second.self > b.second.self;
+                });
+      const std::size_t maxFunctions = 10;
+      for (std::size_t i = 0; i < functions.size() && i < maxFunctions; ++i)
+      {
+        outFile << "    " << functions[i].second.self << " self, " << functions[i].second.inclusive
+                << " incl: " << functions[i].first << "\n";
+      }
+    }
+
+    outFile.close();
+  }
+#endif
+
+private:
+  static std::atomic<std::uint64_t> &nextInstanceId()
+  {
+    static std::atomic<std::uint64_t> next{1};
+    return next;
+  }
+
+  /// @brief Profilers alive in the process, exiting threads only notify these
+  static std::mutex &instancesMutex()
+  {
+    static std::mutex mutex;
+    return mutex;
+  }
+
+  static std::unordered_map<std::uint64_t, BasicProfiler *> &liveInstances()
+  {
+    static std::unordered_map<std::uint64_t, BasicProfiler *> instances;
+    return instances;
+  }
+
+  static BasicProfiler *&currentProfiler()
+  {
+    static thread_local BasicProfiler *selected = nullptr;
+    return selected;
+  }
+
+  /// @brief The calling thread's state in every profiler it used, by instance id. Ids are never
+  /// reused, so entries of destroyed profilers cannot match and are pruned when a state is added
+  struct LocalStates
+  {
+    std::uint64_t lastInstance = 0;
+    ThreadState *last = nullptr;
+    std::vector<std::pair<std::uint64_t, ThreadState *>> states;
+
+    /// @brief Runs when a thread that used a profiler exits
+    ~LocalStates()
+    {
+      threadExiting() = true;
+      ProfilerLock lock(instancesMutex());
+      for (const auto &entry : states)
+      {
+        auto it = liveInstances().find(entry.first);
+        if (it != liveInstances().end())
+        {
+          it->second->threadExited(*entry.second);
+        }
+      }
+      states.clear();
+      lastInstance = 0;
+      last = nullptr;
+    }
+  };
+
+  static LocalStates &localStates()
+  {
+    static thread_local LocalStates local;
+    return local;
+  }
+
+  /// @brief Set once the thread has handed its states back, the function hooks of the code that
+  /// still runs on it are ignored. Has no destructor, so it stays readable until the thread ends
+  static bool &threadExiting()
+  {
+    static thread_local bool exiting = false;
+    return exiting;
+  }
+
+  ThreadState &localState()
+  {
+    LocalStates &local = localStates();
+    if (local.lastInstance == instanceId)
+    {
+      return *local.last;
+    }
+
+    ThreadState *state = nullptr;
+    for (const auto &entry : local.states)
+    {
+      if (entry.first == instanceId)
+      {
+        state = entry.second;
+      }
+    }
+    if (!state)
+    {
+      {
+        ProfilerLock lock(instancesMutex());
+        local.states.erase(std::remove_if(local.states.begin(), local.states.end(),
+                                          [](const std::pair<std::uint64_t, ThreadState *> &entry)
+                                          { return !liveInstances().count(entry.first); }),
+                           local.states.end());
+      }
+      ProfilerLock lock(mtx);
+      if (!idleStates.empty())
+      {
+        state = idleStates.back();
+        idleStates.pop_back();
+      }
+      else
+      {
+        threads.emplace_back(new ThreadState());
+        state = threads.back().get();
+        state->threadIndex = static_cast<std::uint32_t>(threads.size());
+      }
+      state->idGenerator.seed(std::random_device()() ^ (static_cast<std::uint64_t>(state->threadIndex) << 32));
+      local.states.emplace_back(instanceId, state);
+      if (Policy::kBenchmark)
+      {
+        pinCurrentThread();
+      }
+    }
+    local.lastInstance = instanceId;
+    local.last = state;
+    return *state;
+  }
+
+  /// @brief Called on the exiting thread. Its state keeps its totals, events and queued spans and
+  /// goes to the next thread that starts, so threads coming and going do not add states. Scopes
+  /// still open, such as the hook frames of the thread's last functions, are dropped
+  void threadExited(ThreadState &state)
+  {
+#if defined(CHRONOSCOPE_SAMPLING)
+    {
+      ProfilerLock lock(state.mtx);
+      disarmSampling(state);
+    }
+#endif
+    state.depth.store(0, std::memory_order_relaxed);
+    for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+    {
+      std::fill(state.activeGroups[level].begin(), state.activeGroups[level].end(), 0);
+    }
+    if (state.hooks)
+    {
+      state.hooks->depth = 0;
+    }
+    ProfilerLock lock(mtx);
+    idleStates.push_back(&state);
+  }
+
+  /// @brief Shortest of many back-to-back start and end readings, the cost of an empty measurement
+  static long long measureBaseline()
+  {
+    long long shortest = std::chrono::nanoseconds::max().count();
+    for (int i = 0; i < 1000; ++i)
+    {
+      TimePoint start = scopeTime();
+      TimePoint end = scopeEndTime();
+      long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+      shortest = elapsed < shortest ? elapsed : shortest;
+    }
+    return shortest > 0 ? shortest : 0;
+  }
+
+  /// @brief Keeps a benchmark thread on the CPU it runs on, so its readings never cross cores
+  static void pinCurrentThread()
+  {
+#if defined(__linux__)
+    pinToCpu(sched_getcpu());
+#endif
+  }
+
+  static void pinToCpu(int cpu)
+  {
+#if defined(__linux__)
+    if (cpu >= 0)
+    {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(cpu, &cpus);
+      sched_setaffinity(0, sizeof(cpus), &cpus);
+    }
+#else
+    (void)cpu;
+#endif
+  }
+
+  static long long nanoseconds(TimePoint tp)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(tp.time_since_epoch()).count();
+  }
+
+  static ClockQuality testClock()
+  {
+    ClockQuality quality;
+    quality.source = ClockTraits<Clock>::name();
+    const std::uint64_t reads = 200000;
+    long long smallest = std::chrono::nanoseconds::max().count();
+    long long previous = nanoseconds(Clock::now());
+    auto start = std::chrono::steady_clock::now();
+    for (std::uint64_t i = 0; i < reads; ++i)
+    {
+      long long now = nanoseconds(Clock::now());
+      if (now < previous)
+      {
+        quality.backwardSteps++;
+      }
+      else if (now > previous && now - previous < smallest)
+      {
+        smallest = now - previous;
+      }
+      previous = now;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    quality.reads = reads;
+    quality.readCost = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+                       static_cast<double>(reads);
+    // A clock that never moved during the test ticks slower than the test took
+    quality.resolution = smallest != std::chrono::nanoseconds::max().count()
+                             ? smallest
+                             : ClockTraits<Clock>::resolution().count();
+    if (ClockTraits<Clock>::cyclesPerNs() > 0)
+    {
+      quality.skewMeasured = measureSkew(quality.maxSkew);
+    }
+    return quality;
+  }
+
+  /// @brief Bounces readings between the first allowed CPU and each other one (up to 16), in both
+  /// directions. A reading taken after another one was seen but earlier than it shows skew.
+  /// Returns false when the thread may only run on one CPU
+  static bool measureSkew(long long &maxSkew)
+  {
+#if defined(__linux__)
+    cpu_set_t original;
+    if (sched_getaffinity(0, sizeof(original), &original) != 0)
+    {
+      return false;
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpus.size() < 16; ++cpu)
+    {
+      if (CPU_ISSET(cpu, &original))
+      {
+        cpus.push_back(cpu);
+      }
+    }
+    if (cpus.size() < 2)
+    {
+      return false;
+    }
+
+    const int rounds = 1000;
+    maxSkew = 0;
+    pinToCpu(cpus[0]);
+    for (std::size_t i = 1; i < cpus.size(); ++i)
+    {
+      std::atomic<int> sent{0};
+      std::atomic<int> answered{0};
+      std::atomic<long long> local{0};
+      std::atomic<long long> remote{0};
+      long long remoteSkew = 0;
+      std::thread peer(
+          [&]()
+          {
+            pinToCpu(cpus[i]);
+            for (int round = 1; round <= rounds; ++round)
+            {
+              while (sent.load(std::memory_order_acquire) != round)
+              {
+              }
+              long long now = nanoseconds(Clock::now());
+              long long seen = local.load(std::memory_order_relaxed);
+              remoteSkew = seen - now > remoteSkew ? seen - now : remoteSkew;
+              remote.store(nanoseconds(Clock::now()), std::memory_order_relaxed);
+              answered.store(round, std::memory_order_release);
+            }
+          });
+      for (int round = 1; round <= rounds; ++round)
+      {
+        local.store(nanoseconds(Clock::now()), std::memory_order_relaxed);
+        sent.store(round, std::memory_order_release);
+        while (answered.load(std::memory_order_acquire) != round)
+        {
+        }
+        long long now = nanoseconds(Clock::now());
+        long long seen = remote.load(std::memory_order_relaxed);
+        maxSkew = seen - now > maxSkew ? seen - now : maxSkew;
+      }
+      peer.join();
+      maxSkew = remoteSkew > maxSkew ? remoteSkew : maxSkew;
+    }
+    sched_setaffinity(0, sizeof(original), &original);
+    return true;
+#else
+    (void)maxSkew;
+    return false;
+#endif
+  }
+
+  static void addProfile(ProfileInfo &total, const ProfileInfo &info)
+  {
+    total.count += info.count;
+    total.duration += info.duration;
+    total.selfDuration += info.selfDuration;
+    total.recursiveCount += info.recursiveCount;
+    total.maxDepth = info.maxDepth > total.maxDepth ? info.maxDepth : total.maxDepth;
+    total.budgetViolations += info.budgetViolations;
+  }
+
+  /// @brief The group a tag value is counted in: its own while the site and key have fewer than
+  /// tagValueLimit values, their overflow group after that
+  TagGroup admitTag(const TagGroup &group)
+  {
+    ProfilerLock lock(tagMtx);
+    if (group.overflow || tagValues.count(group))
+    {
+      return group;
+    }
+    std::size_t &values = tagValueCounts[std::make_pair(group.site, group.key)];
+    if (values >= tagValueLimit)
+    {
+      return TagGroup{group.site, group.key, TagType::Int, 0, true};
+    }
+    values++;
+    tagValues.insert(group);
+    return group;
+  }
+
+  /// @brief Tag totals of the merged profilers and of every thread
+  std::map<TagGroup, ProfileInfo> tagTotals() const
+  {
+    std::map<TagGroup, ProfileInfo> totals;
+    {
+      ProfilerLock lock(mtx);
+      totals = tagData;
+    }
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      for (const auto &tagged : state->tags)
+      {
+        addProfile(totals[tagged.first], tagged.second);
+      }
+    }
+    return totals;
+  }
+
+  long long sinceEpoch(TimePoint tp) const
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(tp - epoch).count();
+  }
+
+  /// @brief Pushes a scope on the thread's stack, logging its open event and span identity
+  void enterScope(ThreadState &state, std::uint32_t site, TimePoint tp, bool request)
+  {
+#if defined(CHRONOSCOPE_SAMPLING)
+    if (state.samplingGeneration != samplingGeneration.load(std::memory_order_relaxed))
+    {
+      armSampling(state);
+    }
+#endif
+
+    // The frame is filled in before the depth is published to the sampling signal handler
+    std::uint32_t depth = state.depth.load(std::memory_order_relaxed);
+    if (depth >= ThreadState::kMaxScopeDepth)
+    {
+      state.depth.store(depth + 1, std::memory_order_relaxed);
+      return;
+    }
+
+    ScopeFrame &frame = state.stack[depth];
+    frame.site = site;
+    std::atomic_signal_fence(std::memory_order_release);
+    state.depth.store(depth + 1, std::memory_order_relaxed);
+    frame.groups = cachedGroups(state, site);
+    frame.outermost = 0;
+    frame.childTime = 0;
+    frame.lap = tp.time_since_epoch().count();
+    frame.lapChildTime = 0;
+    for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+    {
+      std::vector<std::uint32_t> &active = state.activeGroups[level];
+      std::uint32_t group = frame.groups[level];
+      if (group >= active.size())
+      {
+        active.resize(group + 1);
+      }
+      if (active[group]++ == 0)
+      {
+        frame.outermost |= 1u << level;
+      }
+    }
+    frame.recursionDepth = state.activeGroups[0][frame.groups[0]];
+    frame.traced = false;
+    frame.request = request;
+    frame.spanId = 0;
+    frame.tagCount = 0;
+    frame.labelled = false;
+
+    if (kTraceSink == TraceSink::Stream && exportingSpans.load(std::memory_order_relaxed))
+    {
+      const ScopeFrame *parent = depth ? &state.stack[depth - 1] : nullptr;
+      if (request || !parent || !parent->spanId)
+      {
+        frame.traceIdHigh = state.idGenerator();
+        frame.traceIdLow = state.idGenerator();
+      }
+      else
+      {
+        frame.traceIdHigh = parent->traceIdHigh;
+        frame.traceIdLow = parent->traceIdLow;
+      }
+      frame.spanId = state.idGenerator() | 1;
+    }
+
+    if (kTraceSink != TraceSink::None && tracing.load(std::memory_order_relaxed))
+    {
+      ProfilerLock lock(state.mtx);
+      pushEvent(state, TraceEvent{sinceEpoch(tp), site, TraceEventType::Open, TagType::Int});
+      frame.traced = true;
+    }
+  }
+
+  /// @brief Appends a trace event to the thread's ring, overwriting the oldest one once the ring
+  /// holds traceCapacity events. Called with the thread's lock held
+  void pushEvent(ThreadState &state, const TraceEvent &event)
+  {
+    if (state.eventCount == state.events.size() && state.events.size() < traceCapacity.load(std::memory_order_relaxed))
+    {
+      state.events.push_back(event);
+    }
+    else if (state.events.empty())
+    {
+      state.dropped++;
+      return;
+    }
+    else
+    {
+      state.events[state.eventCount % state.events.size()] = event;
+      state.dropped++;
+    }
+    state.eventCount++;
+  }
+
+  /// @brief Pops the innermost scope, recording its time and logging its close event and span
+  void exitScope(ThreadState &state, std::uint32_t site, TimePoint start, TimePoint end)
+  {
+    long long duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    if (Policy::kBenchmark)
+    {
+      duration = duration > baseline ? duration - baseline : 0;
+    }
+    std::uint32_t depth = state.depth.load(std::memory_order_relaxed) - 1;
+    state.depth.store(depth, std::memory_order_relaxed);
+    if (depth >= ThreadState::kMaxScopeDepth)
+    {
+      // Scopes past the stack limit only count as calls, their time stays with the deepest tracked scope
+      recordSite(state, site, duration, 0, 0, 0);
+      return;
+    }
+
+    const ScopeFrame &frame = state.stack[depth];
+    if (depth)
+    {
+      state.stack[depth - 1].childTime += duration;
+    }
+    for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+    {
+      state.activeGroups[level][frame.groups[level]]--;
+    }
+    recordSite(state, site, duration, duration - frame.childTime, frame.outermost, frame.recursionDepth);
+    if (frame.labelled)
+    {
+      ProfilerLock lock(labelMtx);
+      labelTables.find(site)->second.record(frame.labelSlot, frame.labelGeneration, duration,
+                                            duration - frame.childTime);
+    }
+    if (frame.tagCount)
+    {
+      ProfilerLock lock(state.mtx);
+      for (std::uint8_t i = 0; i < frame.tagCount; ++i)
+      {
+        TagGroup group{site, frame.tags[i].key, frame.tags[i].type, frame.tags[i].value, false};
+        auto it = state.tags.find(group);
+        if (it == state.tags.end())
+        {
+          it = state.tags.emplace(admitTag(group), ProfileInfo()).first;
+        }
+        it->second.count++;
+        it->second.duration += duration;
+        it->second.selfDuration += duration - frame.childTime;
+      }
+    }
+
+    if (!frame.traced && !frame.spanId)
+    {
+      return;
+    }
+
+    ProfilerLock lock(state.mtx);
+    if (frame.traced)
+    {
+      pushEvent(state, TraceEvent{sinceEpoch(end), frame.site, TraceEventType::Close, TagType::Int});
+    }
+    if (frame.spanId && exportingSpans.load(std::memory_order_relaxed))
+    {
+      if (state.spans.size() >= spanQueueLimit.load(std::memory_order_relaxed))
+      {
+        state.droppedSpans++;
+        return;
+      }
+      std::uint64_t parentSpanId = (depth && !frame.request) ? state.stack[depth - 1].spanId : 0;
+      state.spans.push_back(SpanRecord{frame.traceIdHigh, frame.traceIdLow, frame.spanId, parentSpanId, frame.site,
+                                       frame.request, sinceEpoch(start), sinceEpoch(end), frame.tagCount, {}});
+      std::copy(frame.tags, frame.tags + frame.tagCount, state.spans.back().tags);
+    }
+  }
+
+  /// @brief Adds one call to the site's totals, outermost has a bit per RollupLevel at which
+  /// the call was not nested in another scope of its group. The Site bit is clear for recursive
+  /// calls, whose time is already part of the outermost activation
+  void recordSite(ThreadState &state, std::uint32_t site, long long duration, long long selfDuration,
+                  std::uint32_t outermost, std::uint32_t recursionDepth)
+  {
+    {
+      // Only a report copying the thread's cells contends for this lock
+      ProfilerLock lock(state.mtx);
+      SiteCell &cell = siteCell(state, site);
+      ProfileInfo &info = cell.info;
+      info.count++;
+      info.selfDuration += selfDuration;
+      if (Policy::kStatistics == StatisticsMode::Histogram)
+      {
+        if (!cell.histogram)
+        {
+          cell.histogram.reset(new LatencyHistogram());
+        }
+        cell.histogram->record(static_cast<std::uint64_t>(duration));
+      }
+      if (outermost & 1u)
+      {
+        info.duration += duration;
+      }
+      if (recursionDepth > 1)
+      {
+        info.recursiveCount++;
+      }
+      if (recursionDepth > info.maxDepth)
+      {
+        info.maxDepth = recursionDepth;
+      }
+      for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+      {
+        if (outermost & (1u << level))
+        {
+          cell.outermost[level] += duration;
+        }
+      }
+    }
+
+    // Frames and objectives are shared, the lock is only taken while one of them is active
+    if (kTimed && (frameOpen.load(std::memory_order_relaxed) || objectivesSet.load(std::memory_order_relaxed)))
+    {
+      ProfilerLock lock(mtx);
+      if (frameOpen.load(std::memory_order_relaxed))
+      {
+        addToFrame(site, 1, selfDuration);
+      }
+      if (!objectives.empty())
+      {
+        trackObjective(site, duration);
+      }
+    }
+  }
+
+  /// @brief The thread's cell of the site, called with the thread's lock held
+  static SiteCell &siteCell(ThreadState &state, std::uint32_t site)
+  {
+    if (site >= state.sites.size())
+    {
+      state.sites.resize(site + 1);
+    }
+    return state.sites[site];
+  }
+
+  /// @brief Adds cells to totals of the same sites. Histograms are only copied when asked for
+  static void addCells(std::vector<SiteCell> &totals, const std::vector<SiteCell> &cells, bool histograms)
+  {
+    if (cells.size() > totals.size())
+    {
+      totals.resize(cells.size());
+    }
+    for (std::size_t site = 0; site < cells.size(); ++site)
+    {
+      SiteCell &total = totals[site];
+      addProfile(total.info, cells[site].info);
+      for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+      {
+        total.outermost[level] += cells[site].outermost[level];
+      }
+      if (histograms && cells[site].histogram)
+      {
+        if (!total.histogram)
+        {
+          total.histogram.reset(new LatencyHistogram());
+        }
+        total.histogram->merge(*cells[site].histogram);
+      }
+    }
+  }
+
+  /// @brief Site statistics of the merged profilers and of every thread, indexed by site id.
+  /// Each thread's lock is held only while its cells are added
+  std::vector<SiteCell> siteTotals(bool histograms) const
+  {
+    std::vector<SiteCell> totals;
+    {
+      ProfilerLock lock(mtx);
+      addCells(totals, mergedSites, histograms);
+    }
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      addCells(totals, state->sites, histograms);
+    }
+    return totals;
+  }
+
+  /// @brief Index of the site's tracker for the objective, a tracker that followed an older
+  /// objective restarts. Called with the lock held
+  std::int32_t objectiveTracker(std::uint32_t site, std::size_t objective)
+  {
+    std::size_t found = 0;
+    while (found < objectiveTrackers.size() && objectiveTrackers[found].site != site)
+    {
+      found++;
+    }
+    if (found == objectiveTrackers.size())
+    {
+      objectiveTrackers.emplace_back();
+      objectiveTrackers.back().site = site;
+    }
+    else if (objectiveTrackers[found].objective == objective && !objectiveTrackers[found].slots.empty())
+    {
+      return static_cast<std::int32_t>(found);
+    }
+
+    ObjectiveTracker &tracker = objectiveTrackers[found];
+    std::chrono::seconds longest(0);
+    for (const std::chrono::seconds &window : objectives[objective].second.windows)
+    {
+      longest = window > longest ? window : longest;
+    }
+    tracker.objective = objective;
+    tracker.good = 0;
+    tracker.bad = 0;
+    tracker.slots.assign(static_cast<std::size_t>(longest.count() / kObjectiveSlotSeconds + 1),
+                         typename ObjectiveTracker::Slot());
+    tracker.worst.clear();
+    return static_cast<std::int32_t>(found);
+  }
+
+  static long long objectiveSlot(TimePoint tp)
+  {
+    return std::chrono::duration_cast<std::chrono::seconds>(tp.time_since_epoch()).count() / kObjectiveSlotSeconds;
+  }
+
+  /// @brief Counts a call of a site against its objective, called with the lock held
+  void trackObjective(std::uint32_t site, long long duration)
+  {
+    if (site >= objectiveSlots.size())
+    {
+      objectiveSlots.resize(site + 1, static_cast<std::int32_t>(kUnresolvedObjective));
+    }
+    std::int32_t &index = objectiveSlots[site];
+    if (index == kUnresolvedObjective)
+    {
+      const SiteInfo &info = SiteRegistry::getInstance().site(site);
+      index = kNoObjective;
+      for (std::size_t i = objectives.size(); i-- > 0;)
+      {
+        const std::string &name = objectives[i].first;
+        if (name == info.qualifiedName || name == info.functionName || name == info.identifier)
+        {
+          index = objectiveTracker(site, i);
+          break;
+        }
+      }
+    }
+    if (index < 0)
+    {
+      return;
+    }
+
+    ObjectiveTracker &tracker = objectiveTrackers[index];
+    const LatencyObjective &objective = objectives[tracker.objective].second;
+    auto now = Clock::now();
+    bool good = duration <= std::chrono::duration_cast<std::chrono::nanoseconds>(objective.threshold).count();
+    long long slot = objectiveSlot(now);
+    typename ObjectiveTracker::Slot &bucket = tracker.slots[static_cast<std::size_t>(slot) % tracker.slots.size()];
+    if (bucket.slot != slot)
+    {
+      bucket.slot = slot;
+      bucket.good = 0;
+      bucket.bad = 0;
+    }
+    if (good)
+    {
+      tracker.good++;
+      bucket.good++;
+      return;
+    }
+    tracker.bad++;
+    bucket.bad++;
+
+    // The slowest calls are kept in a min-heap, its front is the fastest of them
+    auto faster = [](const SlowCall &a, const SlowCall &b) { return a.duration > b.duration; };
+    SlowCall call{duration, sinceEpoch(now) - duration};
+    if (tracker.worst.size() < objective.worstCalls)
+    {
+      tracker.worst.push_back(call);
+      std::push_heap(tracker.worst.begin(), tracker.worst.end(), faster);
+    }
+    else if (!tracker.worst.empty() && tracker.worst.front().duration < duration)
+    {
+      std::pop_heap(tracker.worst.begin(), tracker.worst.end(), faster);
+      tracker.worst.back() = call;
+      std::push_heap(tracker.worst.begin(), tracker.worst.end(), faster);
+    }
+  }
+
+  /// @brief Counts an overrun of a RECORD_CALL_BUDGET() scope and hands it to the callback.
+  /// Only reached from a Timer whose duration already exceeded the budget
+  void budgetExceeded(ThreadState &state, std::uint32_t site, long long duration, long long budget)
+  {
+    BudgetViolation violation{site, duration, budget, state.threadIndex};
+    std::shared_ptr<std::function<void(const BudgetViolation &)>> callback;
+    {
+      ProfilerLock lock(state.mtx);
+      siteCell(state, site).info.budgetViolations++;
+    }
+    {
+      ProfilerLock lock(mtx);
+      if (!budgetCallback)
+      {
+        return;
+      }
+      if (budgetDeferred)
+      {
+        if (budgetQueue.size() < budgetQueueLimit)
+        {
+          budgetQueue.push_back(violation);
+        }
+        return;
+      }
+      callback = budgetCallback;
+    }
+    (*callback)(violation);
+  }
+
+  /// @brief Runs on the budget worker, calls the deferred callback for the queued overruns
+  void deliverBudgetViolations()
+  {
+    std::vector<BudgetViolation> violations;
+    std::shared_ptr<std::function<void(const BudgetViolation &)>> callback;
+    {
+      ProfilerLock lock(mtx);
+      violations.swap(budgetQueue);
+      callback = budgetCallback;
+    }
+    if (!callback)
+    {
+      return;
+    }
+    for (const BudgetViolation &violation : violations)
+    {
+      (*callback)(violation);
+    }
+  }
+
+  /// @brief Slot of the label in the site's label table, looked up before the scope starts its clock.
+  /// Exact slots come from the thread's cache, only the other labels take the label lock
+  std::uint32_t labelSlot(ThreadState &state, std::uint32_t site, const char *label, std::size_t length,
+                          std::uint32_t &generation)
+  {
+    std::uint64_t hash = textHash(label, length) ^ (site * 0x9e3779b97f4a7c15ull);
+    LabelCache::Entry &entry = state.labels.entries[hash % LabelCache::kEntries];
+    if (entry.text && entry.hash == hash && entry.site == site && entry.length == length &&
+        std::memcmp(entry.text, label, length) == 0)
+    {
+      // Exact slots are never evicted, so their generation stays 0
+      generation = 0;
+      return entry.slot;
+    }
+
+    ProfilerLock lock(labelMtx);
+    auto it = labelTables.find(site);
+    if (it == labelTables.end())
+    {
+      it = labelTables.emplace(site, LabelTable(labelLimit, labelSketchSize)).first;
+    }
+    std::uint32_t slot = it->second.slot(std::string(label, length), generation);
+    if (const std::string *stored = it->second.exactLabel(slot))
+    {
+      entry.hash = hash;
+      entry.site = site;
+      entry.text = stored->c_str();
+      entry.length = length;
+      entry.slot = slot;
+    }
+    return slot;
+  }
+
+  /// @brief Attributes the thread's innermost scope, just opened, to the label slot
+  void labelScope(ThreadState &state, std::uint32_t slot, std::uint32_t generation)
+  {
+    std::uint32_t depth = state.depth.load(std::memory_order_relaxed);
+    if (!depth || depth > ThreadState::kMaxScopeDepth)
+    {
+      return;
+    }
+    ScopeFrame &frame = state.stack[depth - 1];
+    frame.labelSlot = slot;
+    frame.labelGeneration = generation;
+    frame.labelled = true;
+  }
+
+  /// @brief FNV-1a
+  static std::uint64_t textHash(const char *text, std::size_t length)
+  {
+    std::uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < length; ++i)
+    {
+      hash = (hash ^ static_cast<unsigned char>(text[i])) * 1099511628211ull;
+    }
+    return hash;
+  }
+
+  std::uint32_t internedId(const char *text, std::size_t length)
+  {
+    std::uint64_t hash = textHash(text, length);
+    InternCache::Entry &entry = localState().strings.entries[hash % InternCache::kEntries];
+    if (entry.text && entry.hash == hash && entry.length == length && std::memcmp(entry.text, text, length) == 0)
+    {
+      return entry.id;
+    }
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::uint32_t id = registry.intern(text, length);
+    entry.hash = hash;
+    entry.text = registry.internedString(id).c_str();
+    entry.length = length;
+    entry.id = id;
+    return id;
+  }
+
+  void addTag(std::uint32_t key, TagType type, std::uint64_t value)
+  {
+    ThreadState &state = localState();
+    std::uint32_t depth = state.depth.load(std::memory_order_relaxed);
+    if (!depth || depth > ThreadState::kMaxScopeDepth)
+    {
+      return;
+    }
+    ScopeFrame &frame = state.stack[depth - 1];
+    if (frame.tagCount < sizeof(frame.tags) / sizeof(frame.tags[0]))
+    {
+      frame.tags[frame.tagCount++] = ScopeTag{key, type, value};
+    }
+    if (frame.traced)
+    {
+      ProfilerLock lock(state.mtx);
+      pushEvent(state, TraceEvent{static_cast<long long>(value), key, TraceEventType::Tag, type});
+    }
+  }
+
+  /// @brief Tag value as text, strings without quotes
+  static std::string tagText(const ScopeTag &tag)
+  {
+    std::stringstream ss;
+    switch (tag.type)
+    {
+    case TagType::Int:
+      ss << static_cast<long long>(tag.value);
+      break;
+    case TagType::Double:
+    {
+      double number = 0;
+      std::memcpy(&number, &tag.value, sizeof(number));
+      ss << number;
+      break;
+    }
+    case TagType::Bool:
+      ss << (tag.value ? "true" : "false");
+      break;
+    case TagType::String:
+      return SiteRegistry::getInstance().internedString(static_cast<std::uint32_t>(tag.value));
+    }
+    return ss.str();
+  }
+
+  static bool isFiniteTag(const ScopeTag &tag)
+  {
+    double number = 0;
+    std::memcpy(&number, &tag.value, sizeof(number));
+    return tag.type != TagType::Double || std::isfinite(number);
+  }
+
+  /// @brief Writes the tag value as a JSON value, NaN and infinities as strings
+  static void writeTagJson(std::ostream &out, const ScopeTag &tag)
+  {
+    if (tag.type == TagType::String || !isFiniteTag(tag))
+    {
+      writeJsonString(out, tagText(tag));
+    }
+    else
+    {
+      out << tagText(tag);
+    }
+  }
+
+  /// @brief Writes the tag as an OTLP KeyValue
+  static void writeOtlpTag(std::ostream &out, const ScopeTag &tag)
+  {
+    out << "{\"key\":";
+    writeJsonString(out, SiteRegistry::getInstance().internedString(tag.key));
+    out << ",\"value\":{";
+    switch (tag.type)
+    {
+    case TagType::Int:
+      out << "\"intValue\":\"" << tagText(tag) << "\"";
+      break;
+    case TagType::Double:
+      out << "\"doubleValue\":";
+      writeTagJson(out, tag);
+      break;
+    case TagType::Bool:
+      out << "\"boolValue\":" << tagText(tag);
+      break;
+    case TagType::String:
+      out << "\"stringValue\":";
+      writeJsonString(out, tagText(tag));
+      break;
+    }
+    out << "}}";
+  }
+
+  /// @brief Adds to the open frame's breakdown, called with the lock held
+  void addToFrame(std::uint32_t site, std::uint64_t count, long long selfDuration)
+  {
+    if (site >= frameSlots.size())
+    {
+      frameSlots.resize(site + 1);
+    }
+    FrameSlot &slot = frameSlots[site];
+    if (slot.frame != frameIndex)
+    {
+      slot.frame = frameIndex;
+      slot.count = 0;
+      slot.selfDuration = 0;
+      frameTouched.push_back(site);
+    }
+    slot.count += count;
+    slot.selfDuration += selfDuration;
+  }
+
+  /// @brief Closes the open frame into the history, called with the lock held
+  void finishFrame(TimePoint end)
+  {
+    FrameRecord record;
+    record.index = frameIndex;
+    record.start = sinceEpoch(frameStart);
+    record.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - frameStart).count();
+    record.overBudget = frameBudget && record.duration > frameBudget;
+    record.sites.reserve(frameTouched.size());
+    for (std::uint32_t site : frameTouched)
+    {
+      const FrameSlot &slot = frameSlots[site];
+      record.sites.push_back(FrameSiteTime{site, slot.count, slot.selfDuration});
+      if (record.overBudget)
+      {
+        FrameSlot &overrun = overrunSites[site];
+        overrun.frame++;
+        overrun.count += slot.count;
+        overrun.selfDuration += slot.selfDuration;
+      }
+    }
+    std::sort(record.sites.begin(), record.sites.end(),
+              [](const FrameSiteTime &a, const FrameSiteTime &b) { return a.selfDuration > b.selfDuration; });
+    frameTouched.clear();
+    frameOpen = false;
+
+    frameTimes.record(static_cast<std::uint64_t>(record.duration));
+    if (record.overBudget)
+    {
+      overBudgetFrames++;
+    }
+    if (!worstFrame.index || record.duration > worstFrame.duration)
+    {
+      worstFrame = record;
+    }
+    if (frameHistory)
+    {
+      if (recentFramesRing.size() >= frameHistory)
+      {
+        recentFramesRing.pop_front();
+      }
+      recentFramesRing.push_back(std::move(record));
+    }
+  }
+
+  /// @brief Outermost mask for a site timed without a frame of its own (phases and loops), set at
+  /// every level where none of the thread's open scopes is in the site's group
+  std::uint32_t openGroupsMask(ThreadState &state, std::uint32_t site)
+  {
+    const std::uint32_t *groups = cachedGroups(state, site);
+    std::uint32_t outermost = 0;
+    for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+    {
+      const std::vector<std::uint32_t> &active = state.activeGroups[level];
+      std::uint32_t group = groups[level];
+      if (group >= active.size() || !active[group])
+      {
+        outermost |= 1u << level;
+      }
+    }
+    return outermost;
+  }
+
+  /// @brief Publishes a finished RECORD_LOOP(): the iterations count as calls of the loop site,
+  /// which is a child of the scope the loop ran in
+  void recordLoop(ThreadState &state, std::uint32_t site, std::uint32_t depth, long long childTimeAtStart,
+                  std::uint64_t iterations, long long duration, const LatencyHistogram &histogram)
+  {
+    long long selfDuration = duration;
+    if (depth && depth <= ThreadState::kMaxScopeDepth && state.depth.load(std::memory_order_relaxed) == depth)
+    {
+      ScopeFrame &frame = state.stack[depth - 1];
+      selfDuration -= frame.childTime - childTimeAtStart;
+      frame.childTime += selfDuration;
+    }
+    std::uint32_t outermost = openGroupsMask(state, site);
+    {
+      ProfilerLock lock(state.mtx);
+      SiteCell &cell = siteCell(state, site);
+      ProfileInfo &info = cell.info;
+      info.count += iterations;
+      info.selfDuration += selfDuration;
+      if (info.maxDepth < 1)
+      {
+        info.maxDepth = 1;
+      }
+      for (std::size_t level = 0; level < kRollupLevelCount; ++level)
+      {
+        if (outermost & (1u << level))
+        {
+          cell.outermost[level] += duration;
+        }
+      }
+      if (outermost & 1u)
+      {
+        info.duration += duration;
+      }
+    }
+
+    ProfilerLock lock(mtx);
+    if (frameOpen.load(std::memory_order_relaxed))
+    {
+      addToFrame(site, iterations, selfDuration);
+    }
+    std::unique_ptr<LatencyHistogram> &total = iterationHistograms[site];
+    if (!total)
+    {
+      total.reset(new LatencyHistogram());
+    }
+    total->merge(histogram);
+  }
 
-#define PROFILER_ENABLED
+  /// @brief Registry entry of the site, looked up once per thread
+  static const std::uint32_t *cachedGroups(ThreadState &state, std::uint32_t site)
+  {
+    if (site >= state.siteGroups.size())
+    {
+      state.siteGroups.resize(site + 1, nullptr);
+    }
+    if (!state.siteGroups[site])
+    {
+      state.siteGroups[site] = SiteRegistry::getInstance().groups(site);
+    }
+    return state.siteGroups[site];
+  }
 
-class Timer;
+  /// @brief Drains the span queues of all threads and appends them to the OTLP file
+  void exportSpans(std::ostream &out)
+  {
+    std::vector<ThreadState *> states = threadStates();
 
-struct ProfileInfo
-{
-  unsigned int count = 0;
-  long long duration = 0;
-};
+    std::vector<std::pair<std::uint32_t, SpanRecord>> batch;
+    for (ThreadState *state : states)
+    {
+      std::vector<SpanRecord> spans;
+      {
+        ProfilerLock lock(state->mtx);
+        spans.swap(state->spans);
+      }
+      for (const SpanRecord &span : spans)
+      {
+        batch.emplace_back(state->threadIndex, span);
+        if (batch.size() >= otlpOptions.batchSize)
+        {
+          writeOtlpBatch(out, batch);
+          batch.clear();
+        }
+      }
+    }
+    if (!batch.empty())
+    {
+      writeOtlpBatch(out, batch);
+    }
+    out.flush();
+  }
 
-/// @brief A profiler class that records the number of calls to a function/method
-/// and the time spent in a function/method
-class Profiler
-{
-  friend class Timer;
+  void writeOtlpBatch(std::ostream &out, const std::vector<std::pair<std::uint32_t, SpanRecord>> &batch) const
+  {
+    SiteRegistry &registry = SiteRegistry::getInstance();
 
-public:
-  static Profiler &getInstance()
+    out << "{\"resourceSpans\":[{\"resource\":{\"attributes\":[";
+    writeOtlpAttribute(out, "service.name", otlpOptions.serviceName);
+    for (const auto &attribute : otlpOptions.resourceAttributes)
+    {
+      out << ",";
+      writeOtlpAttribute(out, attribute.first, attribute.second);
+    }
+    out << "]},\"scopeSpans\":[{\"scope\":{\"name\":\"chronoscope\"},\"spans\":[";
+
+    bool first = true;
+    for (const auto &entry : batch)
+    {
+      const SpanRecord &span = entry.second;
+      const SiteInfo &info = registry.site(span.site);
+      out << (first ? "" : ",") << "{\"traceId\":\"" << toHex(span.traceIdHigh) << toHex(span.traceIdLow)
+          << "\",\"spanId\":\"" << toHex(span.spanId) << "\"";
+      if (span.parentSpanId)
+      {
+        out << ",\"parentSpanId\":\"" << toHex(span.parentSpanId) << "\"";
+      }
+      out << ",\"name\":";
+      writeJsonString(out, info.displayName);
+      out << ",\"kind\":" << (span.request ? 2 : 1) << ",\"startTimeUnixNano\":\"" << wallEpoch + span.start
+          << "\",\"endTimeUnixNano\":\"" << wallEpoch + span.end << "\",\"attributes\":[";
+      writeOtlpAttribute(out, "code.function", info.qualifiedName);
+      out << ",";
+      writeOtlpAttribute(out, "code.filepath", info.fileName);
+      out << ",{\"key\":\"code.lineno\",\"value\":{\"intValue\":\"" << info.lineNo
+          << "\"}},{\"key\":\"thread.id\",\"value\":{\"intValue\":\"" << entry.first << "\"}}";
+      for (std::uint8_t i = 0; i < span.tagCount; ++i)
+      {
+        out << ",";
+        writeOtlpTag(out, span.tags[i]);
+      }
+      out << "]}";
+      first = false;
+    }
+    out << "]}]}]}\n";
+  }
+
+  static void writeOtlpAttribute(std::ostream &out, const std::string &key, const std::string &value)
   {
-    static Profiler instance;
-    return instance;
+    out << "{\"key\":";
+    writeJsonString(out, key);
+    out << ",\"value\":{\"stringValue\":";
+    writeJsonString(out, value);
+    out << "}}";
   }
 
-  void recordTimeAndCalls(const std::string &functionName, const std::string &fileName, int lineNo, long long duration)
+  static std::string toHex(std::uint64_t value)
   {
-    std::lock_guard<std::mutex> lock(mtx);
-    std::stringstream ss;
-    ss << fileName << ":" << lineNo << ":" << functionName;
-    std::string funcIdentifier = ss.str();
-    ProfileInfo &info = profileData[funcIdentifier];
-    info.count++;
-    info.duration += duration;
+    const char *digits = "0123456789abcdef";
+    std::string hex(16, '0');
+    for (int i = 15; i >= 0; --i, value >>= 4)
+    {
+      hex[i] = digits[value & 0xf];
+    }
+    return hex;
+  }
+
+  /// @brief Sends the difference between the current totals and the ones sent last time
+  void exportStatsd(const StatsdExportOptions &options, UdpSocket &socket, std::uint64_t &generation,
+                    std::vector<ProfileInfo> &lastSent, std::vector<MetricSnapshot> &lastMetrics) const
+  {
+    // After a reset() the totals start again from zero
+    std::uint64_t resets = resetGeneration.load(std::memory_order_relaxed);
+    if (resets != generation)
+    {
+      generation = resets;
+      lastSent.clear();
+      lastMetrics.clear();
+    }
+    std::vector<ProfileInfo> current;
+    for (const SiteCell &cell : siteTotals(false))
+    {
+      current.push_back(cell.info);
+    }
+    lastSent.resize(current.size());
+
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::string packet;
+    auto append = [this, &packet, &socket, &options](std::stringstream &lines)
+    {
+      for (std::string line; std::getline(lines, line);)
+      {
+        if (line.size() > options.maxPacketSize)
+        {
+          // A truncated line would be misparsed, and an oversized datagram dropped or fragmented
+          statsdOversize.fetch_add(1, std::memory_order_relaxed);
+          continue;
+        }
+        if (!packet.empty() && packet.size() + 1 + line.size() > options.maxPacketSize)
+        {
+          socket.send(packet);
+          packet.clear();
+        }
+        packet += packet.empty() ? line : "\n" + line;
+      }
+    };
+    for (std::uint32_t site = 0; site < current.size(); ++site)
+    {
+      // A reset() racing the copy above can leave totals below the last ones sent
+      if (current[site].count < lastSent[site].count)
+      {
+        lastSent[site] = ProfileInfo();
+      }
+      std::uint64_t calls = current[site].count - lastSent[site].count;
+      long long time = (current[site].duration - lastSent[site].duration) / 1000;
+      lastSent[site] = current[site];
+      if (!calls)
+      {
+        continue;
+      }
+
+      const SiteInfo &info = registry.site(site);
+      std::string name;
+      std::string suffix;
+      if (options.dogstatsd)
+      {
+        std::stringstream ss;
+        ss << "|#function:" << statsdSanitize(info.functionName) << ",file:" << statsdSanitize(info.fileName)
+           << ",line:" << info.lineNo;
+        for (const std::string &tag : options.tags)
+        {
+          ss << "," << tag;
+        }
+        name = options.prefix;
+        suffix = ss.str();
+      }
+      else
+      {
+        std::stringstream ss;
+        ss << options.prefix << "." << statsdSanitize(info.fileName, false) << "_" << info.lineNo << "_"
+           << statsdSanitize(info.functionName, false);
+        name = ss.str();
+      }
+
+      std::stringstream lines;
+      lines << name << ".calls:" << calls << "|c" << suffix << "\n"
+            << name << ".time_us:" << time << "|c" << suffix << "\n"
+            << name << ".avg_us:" << time / calls << "|g" << suffix << "\n";
+      append(lines);
+    }
+
+    // Metrics are sent under their own name: counter deltas, the last gauge value and the
+    // count and mean of the interval's value samples
+    std::vector<MetricSnapshot> metricsNow = metrics();
+    lastMetrics.resize(metricsNow.size());
+    for (std::size_t i = 0; i < metricsNow.size(); ++i)
+    {
+      const MetricSnapshot &metric = metricsNow[i];
+      if (metric.count < lastMetrics[i].count)
+      {
+        lastMetrics[i] = MetricSnapshot();
+      }
+      std::uint64_t updates = metric.count - lastMetrics[i].count;
+      double sum = metric.sum - lastMetrics[i].sum;
+      lastMetrics[i].count = metric.count;
+      lastMetrics[i].sum = metric.sum;
+      if (!updates)
+      {
+        continue;
+      }
+
+      std::stringstream suffix;
+      if (options.dogstatsd && !options.tags.empty())
+      {
+        suffix << "|#";
+        for (std::size_t t = 0; t < options.tags.size(); ++t)
+        {
+          suffix << (t ? "," : "") << options.tags[t];
+        }
+      }
+      std::string name = options.prefix + "." + statsdSanitize(metric.name);
+      std::stringstream lines;
+      switch (metric.kind)
+      {
+      case MetricKind::Counter:
+        lines << name << ":" << sum << "|c" << suffix.str() << "\n";
+        break;
+      case MetricKind::Gauge:
+        lines << name << ":" << metric.last << "|g" << suffix.str() << "\n";
+        break;
+      case MetricKind::Value:
+        lines << name << ".count:" << updates << "|c" << suffix.str() << "\n"
+              << name << ".avg:" << sum / static_cast<double>(updates) << "|g" << suffix.str() << "\n";
+        break;
+      }
+      append(lines);
+    }
+    if (!packet.empty())
+    {
+      socket.send(packet);
+    }
+  }
+
+  /// @brief Replaces characters that have a meaning in the StatsD line protocol. Dots are
+  /// kept only in tag values, in metric names they would split the site into hierarchy levels
+  static std::string statsdSanitize(const std::string &value, bool keepDots = true)
+  {
+    std::string result(value);
+    for (char &c : result)
+    {
+      if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-' && (!keepDots || (c != '.' && c != '/')))
+      {
+        c = '_';
+      }
+    }
+    return result;
+  }
+
+  std::vector<ThreadState *> threadStates() const
+  {
+    std::vector<ThreadState *> states;
+    ProfilerLock lock(mtx);
+    for (const auto &state : threads)
+    {
+      states.push_back(state.get());
+    }
+    return states;
+  }
+
+#if defined(CHRONOSCOPE_SYMBOLS)
+  static const std::string &symbolName(void *address)
+  {
+    return Symbolizer::getInstance().resolve(address).function;
+  }
+
+  /// @brief Site of an instrumented function, looked up in the registry the first time a thread calls it
+  std::uint32_t functionSite(void *function)
+  {
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    std::uint32_t site = SiteRegistry::kNoSite;
+    if (registry.findAddress(function, site))
+    {
+      return site;
+    }
+
+    std::vector<std::string> include;
+    std::vector<std::string> exclude;
+    {
+      ProfilerLock lock(mtx);
+      include = functionInclude;
+      exclude = functionExclude;
+    }
+
+    if (!include.empty() || !exclude.empty())
+    {
+      const std::string &name = symbolName(function);
+      bool included = include.empty();
+      bool excluded = false;
+      for (const std::string &pattern : include)
+      {
+        included = included || name.find(pattern) != std::string::npos;
+      }
+      for (const std::string &pattern : exclude)
+      {
+        excluded = excluded || name.find(pattern) != std::string::npos;
+      }
+      if (!included || excluded)
+      {
+        registry.excludeAddress(function);
+        return SiteRegistry::kNoSite;
+      }
+    }
+    return registry.registerAddress(function);
   }
 
-  void dumpTextReport(const std::string &filename) const
+#endif
+
+#if defined(CHRONOSCOPE_SAMPLING)
+  static void installSampleHandler()
+  {
+    static std::once_flag installed;
+    std::call_once(installed,
+                   []()
+                   {
+                     // The first backtrace() call loads the unwinder, which is not safe inside a signal handler
+                     void *frames[4];
+                     backtrace(frames, 4);
+
+                     struct sigaction action = {};
+                     action.sa_sigaction = &BasicProfiler::onSampleSignal;
+                     action.sa_flags = SA_SIGINFO | SA_RESTART;
+                     sigemptyset(&action.sa_mask);
+                     sigaction(SIGPROF, &action, nullptr);
+                   });
+  }
+
+  /// @brief SIGPROF handler, only uses async-signal-safe calls and the thread's own ring
+  static void onSampleSignal(int, siginfo_t *, void *)
+  {
+    int savedErrno = errno;
+    ThreadState *state = sampledState();
+    SampleRing *ring = state ? state->sampleRing.get() : nullptr;
+    if (ring)
+    {
+      std::uint32_t head = ring->head.load(std::memory_order_relaxed);
+      if (head - ring->tail.load(std::memory_order_acquire) >= SampleRing::kCapacity)
+      {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+      }
+      else
+      {
+        StackSample &sample = ring->slots[head % SampleRing::kCapacity];
+        sample.at = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+
+        // Skip the handler itself and the signal trampoline
+        const int skipped = 2;
+        void *frames[StackSample::kMaxFrames + skipped];
+        int count = backtrace(frames, StackSample::kMaxFrames + skipped);
+        sample.frameCount = count > skipped ? static_cast<std::uint32_t>(count - skipped) : 0;
+        for (std::uint32_t i = 0; i < sample.frameCount; ++i)
+        {
+          sample.frames[i] = frames[i + skipped];
+        }
+
+        std::uint32_t depth = state->depth.load(std::memory_order_relaxed);
+        std::atomic_signal_fence(std::memory_order_acquire);
+        if (depth > ThreadState::kMaxScopeDepth)
+        {
+          depth = ThreadState::kMaxScopeDepth;
+        }
+        std::uint32_t first = depth > StackSample::kMaxScopes ? depth - StackSample::kMaxScopes : 0;
+        sample.scopeCount = depth - first;
+        for (std::uint32_t i = 0; i < sample.scopeCount; ++i)
+        {
+          sample.scopes[i] = state->stack[first + i].site;
+        }
+        ring->head.store(head + 1, std::memory_order_release);
+      }
+    }
+    errno = savedErrno;
+  }
+
+  /// @brief Creates the SIGPROF timer of the calling thread, which must own state
+  void armSampling(ThreadState &state)
   {
-    if (profileData.empty())
-    {      
+    ProfilerLock lock(state.mtx);
+    state.samplingGeneration = samplingGeneration.load(std::memory_order_relaxed);
+    disarmSampling(state);
+    if (!samplingActive.load(std::memory_order_relaxed))
+    {
       return;
     }
+    if (!state.sampleRing)
+    {
+      state.sampleRing.reset(new SampleRing());
+    }
 
-    std::ofstream outFile(filename);
-    if (!outFile.is_open())
+    sigevent event = {};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = static_cast<pid_t>(syscall(SYS_gettid));
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, &state.samplingTimer) != 0)
     {
-      std::cerr << "Failed to open file for writing: " << filename << std::endl;
       return;
     }
 
-    std::vector<std::pair<std::string, ProfileInfo>> entries(profileData.begin(), profileData.end());
-    std::sort(entries.begin(), entries.end(),
-              [](const std::pair<std::string, ProfileInfo> &a, const std::pair<std::string, ProfileInfo> &b)
-              {
-                if (a.second.duration != b.second.duration)
-                  return a.second.duration > b.second.duration;
-                return a.second.count > b.second.count;
-              });
+    long long interval = samplingInterval.load(std::memory_order_relaxed);
+    itimerspec spec = {};
+    spec.it_interval.tv_sec = static_cast<time_t>(interval / 1000000000);
+    spec.it_interval.tv_nsec = static_cast<long>(interval % 1000000000);
+    spec.it_value = spec.it_interval;
+    timer_settime(state.samplingTimer, 0, &spec, nullptr);
+    state.samplingArmed = true;
+    sampledState() = &state;
+  }
 
-    // Write out the sorted data
-    outFile << "===== Profiling Report =====\n";
-    for (const auto &entry : entries)
+  /// @brief State of the calling thread in the profiler whose timer last armed on it, read by the
+  /// signal handler. Only one profiler should sample at a time
+  static ThreadState *&sampledState()
+  {
+    static thread_local ThreadState *state = nullptr;
+    return state;
+  }
+
+  /// @brief Expects state.mtx to be held
+  static void disarmSampling(ThreadState &state)
+  {
+    if (state.samplingArmed)
     {
-      outFile << entry.first << ": " << entry.second.duration << " us, "
-              << entry.second.count << " calls\n";
+      timer_delete(state.samplingTimer);
+      state.samplingArmed = false;
     }
+  }
 
-    outFile.close();
+  /// @brief Moves the samples out of the signal rings into the per-thread sample logs
+  void drainSamples() const
+  {
+    long long epochNs = std::chrono::duration_cast<std::chrono::nanoseconds>(epoch.time_since_epoch()).count();
+    for (ThreadState *state : threadStates())
+    {
+      ProfilerLock lock(state->mtx);
+      SampleRing *ring = state->sampleRing.get();
+      if (!ring)
+      {
+        continue;
+      }
+      std::uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+      std::uint32_t head = ring->head.load(std::memory_order_acquire);
+      for (; tail != head; ++tail)
+      {
+        const StackSample &slot = ring->slots[tail % SampleRing::kCapacity];
+        RecordedSample sample;
+        sample.at = slot.at - epochNs;
+        // Return addresses point past the call, step back into the calling instruction
+        for (std::uint32_t i = 0; i < slot.frameCount; ++i)
+        {
+          sample.frames.push_back(i ? static_cast<char *>(slot.frames[i]) - 1 : slot.frames[i]);
+        }
+        sample.scopes.assign(slot.scopes, slot.scopes + slot.scopeCount);
+        state->samples.push_back(std::move(sample));
+      }
+      ring->tail.store(tail, std::memory_order_release);
+    }
   }
 
-private:
-  Profiler() {}
-  Profiler(Profiler const &) = delete;
-  Profiler(Profiler &&) = delete;
-  void operator=(Profiler const &) = delete;
-  void operator=(Profiler &&) = delete;
+  /// @brief Unqualified function name of a demangled symbol, without template arguments,
+  /// parameters or return type, comparable to __FUNCTION__
+  static std::string baseFunctionName(const std::string &symbol)
+  {
+    std::size_t end = symbol.size();
+    int nesting = 0;
+    for (std::size_t i = 0; i < symbol.size(); ++i)
+    {
+      char c = symbol[i];
+      if (c == '<')
+        nesting++;
+      else if (c == '>')
+        nesting--;
+      else if (c == '(' && nesting == 0 && i > 0)
+      {
+        end = i;
+        break;
+      }
+    }
+
+    std::size_t begin = 0;
+    nesting = 0;
+    for (std::size_t i = end; i-- > 0;)
+    {
+      char c = symbol[i];
+      if (c == '>')
+        nesting++;
+      else if (c == '<')
+      {
+        nesting--;
+        if (nesting == 0)
+          end = i;
+      }
+      else if (nesting == 0 && (c == ':' || c == ' '))
+      {
+        begin = i + 1;
+        break;
+      }
+    }
+    return symbol.substr(begin, end - begin);
+  }
+
+  /// @brief Number of native frames, leaf first, that ran below the innermost instrumented scope
+  static std::size_t calleeFrameCount(const RecordedSample &sample)
+  {
+    if (sample.scopes.empty())
+    {
+      return sample.frames.size();
+    }
+    const std::string &function = SiteRegistry::getInstance().site(sample.scopes.back()).functionName;
+    for (std::size_t i = 0; i < sample.frames.size(); ++i)
+    {
+      if (baseFunctionName(symbolName(sample.frames[i])) == function)
+      {
+        return i;
+      }
+    }
+    // The scope's function was inlined or has no symbol, only the leaf is known to be below it
+    return sample.frames.empty() ? 0 : 1;
+  }
+#endif
+
+  static void writeJsonString(std::ostream &out, const std::string &value)
+  {
+    out << '"';
+    for (char c : value)
+    {
+      switch (c)
+      {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      case '\r':
+        out << "\\r";
+        break;
+      case '\t':
+        out << "\\t";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20)
+        {
+          const char *hex = "0123456789abcdef";
+          out << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        }
+        else
+        {
+          out << c;
+        }
+      }
+    }
+    out << '"';
+  }
 
+  const std::uint64_t instanceId;
+  /// @brief Nanoseconds an empty measurement takes, subtracted from the scopes of benchmark profilers
+  long long baseline = 0;
+  mutable std::once_flag clockTested;
+  mutable ClockQuality clockTest;
   mutable std::mutex mtx;
-  std::unordered_map<std::string, ProfileInfo> profileData;
+  /// @brief Site statistics added by merge(), indexed by site id
+  std::vector<SiteCell> mergedSites;
+  std::unordered_map<std::uint32_t, std::unique_ptr<LatencyHistogram>> iterationHistograms;
+
+  /// @brief Totals of a site within the open frame. In overrunSites, frame counts the
+  /// over-budget frames the site ran in
+  struct FrameSlot
+  {
+    std::uint64_t frame = 0;
+    std::uint64_t count = 0;
+    long long selfDuration = 0;
+  };
+  /// @brief Written under the lock, read without it by recordSite() to skip the lock between frames
+  std::atomic<bool> frameOpen{false};
+  TimePoint frameStart;
+  std::uint64_t frameIndex = 0;
+  long long frameBudget = 0;
+  std::size_t frameHistory = 256;
+  std::vector<FrameSlot> frameSlots;
+  std::vector<std::uint32_t> frameTouched;
+  std::deque<FrameRecord> recentFramesRing;
+  FrameRecord worstFrame;
+  LatencyHistogram frameTimes;
+  std::uint64_t overBudgetFrames = 0;
+  std::unordered_map<std::uint32_t, FrameSlot> overrunSites;
+
+  static const std::int32_t kNoObjective = -1;
+  static const std::int32_t kUnresolvedObjective = -2;
+  static const long long kObjectiveSlotSeconds = 10;
+  /// @brief Calls of a site against its objective, with good/bad counts per 10 s slot
+  struct ObjectiveTracker
+  {
+    struct Slot
+    {
+      long long slot = -1;
+      std::uint64_t good = 0;
+      std::uint64_t bad = 0;
+    };
+    std::uint32_t site = 0;
+    std::size_t objective = 0;
+    std::uint64_t good = 0;
+    std::uint64_t bad = 0;
+    std::vector<Slot> slots;
+    std::vector<SlowCall> worst;
+  };
+  std::vector<std::pair<std::string, LatencyObjective>> objectives;
+  /// @brief Set with the first objective, lets recordSite() skip the lock until then
+  std::atomic<bool> objectivesSet{false};
+  /// @brief Per site, the index of its tracker, kNoObjective or kUnresolvedObjective
+  std::vector<std::int32_t> objectiveSlots;
+  std::vector<ObjectiveTracker> objectiveTrackers;
+
+  /// @brief Tag totals added by merge()
+  std::map<TagGroup, ProfileInfo> tagData;
+  /// @brief Guards the tag values given a group of their own, taken only for values a thread has
+  /// not used yet and for values past the limit
+  mutable std::mutex tagMtx;
+  std::set<TagGroup> tagValues;
+  /// @brief Number of tagValues per site and key
+  std::map<std::pair<std::uint32_t, std::uint32_t>, std::size_t> tagValueCounts;
+  std::size_t tagValueLimit = 64;
+  /// @brief Guards the label tables apart from mtx, RECORD_CALL_LABEL() calls only take it for
+  /// labels without an exact slot and when the scope ends
+  mutable std::mutex labelMtx;
+  std::unordered_map<std::uint32_t, LabelTable> labelTables;
+  std::size_t labelLimit = 32;
+  std::size_t labelSketchSize = 16;
+  /// @brief Metrics added by merge(), indexed by metric id
+  std::vector<MetricCell> mergedMetrics;
+  std::vector<std::unique_ptr<ThreadState>> threads;
+  /// @brief States of exited threads, handed to the next threads that start
+  std::vector<ThreadState *> idleStates;
+
+  TimePoint epoch;
+  long long wallEpoch;
+  std::atomic<bool> tracing{true};
+  std::atomic<std::size_t> traceCapacity{1 << 20};
+
+  std::mutex exportControlMtx;
+  PeriodicWorker otlpWorker;
+  OtlpExportOptions otlpOptions;
+  std::atomic<bool> exportingSpans{false};
+  std::atomic<std::size_t> spanQueueLimit{0};
+  mutable std::atomic<std::uint64_t> statsdOversize{0};
+  /// @brief Number of reset() calls, so the StatsD exporter restarts its deltas from zero
+  std::atomic<std::uint64_t> resetGeneration{0};
+  PeriodicWorker statsdWorker;
+
+  std::shared_ptr<std::function<void(const BudgetViolation &)>> budgetCallback;
+  bool budgetDeferred = false;
+  std::size_t budgetQueueLimit = 4096;
+  std::vector<BudgetViolation> budgetQueue;
+  PeriodicWorker budgetWorker;
+
+  std::vector<std::string> functionInclude;
+  std::vector<std::string> functionExclude;
+
+#if defined(CHRONOSCOPE_SAMPLING)
+  PeriodicWorker samplingWorker;
+  std::atomic<bool> samplingActive{false};
+  std::atomic<std::uint32_t> samplingGeneration{0};
+  std::atomic<long long> samplingInterval{1000000};
+#endif
+};
+
+/// @brief Makes a profiler the current one of the calling thread until the end of the scope, so
+/// the RECORD_* macros below it report there. Scopes already open keep their profiler
+template <typename ProfilerType>
+class BasicScopedProfiler
+{
+public:
+  explicit BasicScopedProfiler(ProfilerType &profiler) : previous(ProfilerType::currentProfiler())
+  {
+    ProfilerType::currentProfiler() = &profiler;
+  }
+
+  ~BasicScopedProfiler()
+  {
+    ProfilerType::currentProfiler() = previous;
+  }
+
+  BasicScopedProfiler(BasicScopedProfiler const &) = delete;
+  void operator=(BasicScopedProfiler const &) = delete;
+
+private:
+  ProfilerType *previous;
 };
 
 /// @brief A timer class that records the time spent in a function/method
 /// and reports it to the profiler
-class Timer
+template <typename ProfilerType>
+class BasicTimer
 {
 public:
-  Timer(const std::string &functionName, const std::string &fileName, int lineNo, Profiler &profiler)
-      : funcName(functionName), fileName(fileName), lineNo(lineNo), refProfiler(profiler), start(std::chrono::high_resolution_clock::now())
+  using Duration = typename ProfilerType::Duration;
+  using TimePoint = typename ProfilerType::TimePoint;
+
+  BasicTimer(const std::string &functionName, const std::string &fileName, int lineNo, ProfilerType &profiler)
+      : BasicTimer(SiteRegistry::getInstance().registerSite(functionName, fileName, lineNo), profiler)
   {
-    std::stringstream ss;
-    ss << fileName << ":" << lineNo << ":" << functionName;
-    logStr = ss.str();
   }
 
-  ~Timer()
+  /// @brief A timer with startsRequest set begins a new trace instead of joining the enclosing one
+  BasicTimer(std::uint32_t site, ProfilerType &profiler, bool startsRequest = false)
+      : site(site), refProfiler(profiler), state(profiler.localState()), budget(Duration::max()),
+        start(ProfilerType::scopeTime())
+  {
+    refProfiler.enterScope(state, site, start, startsRequest);
+    if (ProfilerType::kBenchmark)
+    {
+      start = ProfilerType::scopeTime();
+    }
+  }
+
+  /// @brief A timer that reports an overrun to the profiler when the scope takes longer than budget
+  BasicTimer(std::uint32_t site, ProfilerType &profiler, std::chrono::microseconds budget)
+      : site(site), refProfiler(profiler), state(profiler.localState()),
+        budget(std::chrono::duration_cast<Duration>(budget)), start(ProfilerType::scopeTime())
+  {
+    refProfiler.enterScope(state, site, start, false);
+    if (ProfilerType::kBenchmark)
+    {
+      start = ProfilerType::scopeTime();
+    }
+  }
+
+  /// @brief A timer whose call is also counted under label, see RECORD_CALL_LABEL()
+  BasicTimer(std::uint32_t site, ProfilerType &profiler, const char *label, std::size_t length)
+      : site(site), refProfiler(profiler), state(profiler.localState()), budget(Duration::max()),
+        start(ProfilerType::scopeTime())
+  {
+    std::uint32_t generation = 0;
+    std::uint32_t slot = refProfiler.labelSlot(state, site, label, length, generation);
+    start = ProfilerType::scopeTime();
+    refProfiler.enterScope(state, site, start, false);
+    refProfiler.labelScope(state, slot, generation);
+    if (ProfilerType::kBenchmark)
+    {
+      start = ProfilerType::scopeTime();
+    }
+  }
+
+  BasicTimer(std::uint32_t site, ProfilerType &profiler, const char *label)
+      : BasicTimer(site, profiler, label, std::strlen(label))
+  {
+  }
+
+  BasicTimer(std::uint32_t site, ProfilerType &profiler, const std::string &label)
+      : BasicTimer(site, profiler, label.data(), label.size())
   {
-    auto end = std::chrono::high_resolution_clock::now();
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
-    refProfiler.recordTimeAndCalls(funcName, fileName, lineNo, duration);
+  }
+
+  ~BasicTimer()
+  {
+    auto end = ProfilerType::scopeEndTime();
+    refProfiler.exitScope(state, site, start, end);
+    if (ProfilerType::kTimed && end - start > budget)
+    {
+      refProfiler.budgetExceeded(state, site, std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+                                 std::chrono::duration_cast<std::chrono::nanoseconds>(budget).count());
+    }
   }
 
 private:
-  size_t lineNo;
+  std::uint32_t site;
 
-  std::string logStr;
-  std::string funcName;
-  std::string fileName;
+  ProfilerType &refProfiler;
+  ThreadState &state;
+  Duration budget;
+  TimePoint start;
+};
+
+/// @brief Times the iterations of a loop into a local histogram and publishes them to the
+/// loop's site once, when the loop timer goes out of scope
+template <typename ProfilerType>
+class BasicLoopTimer
+{
+public:
+  BasicLoopTimer(std::uint32_t site, ProfilerType &profiler)
+      : site(site), refProfiler(profiler), state(profiler.localState()),
+        depth(state.depth.load(std::memory_order_relaxed)), childTimeAtStart(0), lap(ProfilerType::scopeTime()),
+        previous(innermost())
+  {
+    if (depth && depth <= ThreadState::kMaxScopeDepth)
+    {
+      childTimeAtStart = state.stack[depth - 1].childTime;
+    }
+    innermost() = this;
+  }
+
+  ~BasicLoopTimer()
+  {
+    innermost() = previous;
+    if (iterations)
+    {
+      refProfiler.recordLoop(state, site, depth, childTimeAtStart, iterations, duration, histogram);
+    }
+  }
+
+  BasicLoopTimer(BasicLoopTimer const &) = delete;
+  void operator=(BasicLoopTimer const &) = delete;
+
+  /// @brief The thread's most recently declared loop timer still alive, the one RECORD_ITERATION() ends
+  static BasicLoopTimer *&innermost()
+  {
+    static thread_local BasicLoopTimer *loop = nullptr;
+    return loop;
+  }
+
+  /// @brief Ends the current iteration, which started when the previous one ended
+  void endIteration()
+  {
+    auto now = ProfilerType::scopeTime();
+    long long elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - lap).count();
+    lap = now;
+    duration += elapsed;
+    iterations++;
+    histogram.record(static_cast<std::uint64_t>(elapsed));
+  }
+
+private:
+  std::uint32_t site;
+  ProfilerType &refProfiler;
+  ThreadState &state;
+  std::uint32_t depth;
+  long long childTimeAtStart;
+  typename ProfilerType::TimePoint lap;
+  std::uint64_t iterations = 0;
+  long long duration = 0;
+  LatencyHistogram histogram;
+  BasicLoopTimer *previous;
+};
+
+/// @brief Ends an iteration of the enclosing RECORD_LOOP() when the loop body is left, does
+/// nothing without a loop timer
+class LoopIteration
+{
+public:
+  explicit LoopIteration(LoopTimer *loop) : loop(loop) {}
+  ~LoopIteration()
+  {
+    if (loop)
+    {
+      loop->endIteration();
+    }
+  }
 
-  Profiler &refProfiler;
-  std::chrono::time_point<std::chrono::high_resolution_clock> start;
+private:
+  LoopTimer *loop;
 };
 
+#define CHRONO_CONCAT_IMPL(a, b) a##b
+#define CHRONO_CONCAT(a, b) CHRONO_CONCAT_IMPL(a, b)
+
+/// @brief Fully qualified signature of the enclosing function, a compile-time constant
+#if defined(__cpp_lib_source_location)
+#define CHRONO_FUNCTION_SIGNATURE std::source_location::current().function_name()
+#elif defined(_MSC_VER)
+#define CHRONO_FUNCTION_SIGNATURE __FUNCSIG__
+#else
+#define CHRONO_FUNCTION_SIGNATURE __PRETTY_FUNCTION__
+#endif
+
 #if defined(PROFILER_ENABLED)
-#define RECORD_CALL() Timer timer##__LINE__(__FUNCTION__, __FILE__, __LINE__, Profiler::getInstance())
+#define RECORD_CALL()                                                                                                   \
+  static constexpr SiteDescriptor CHRONO_CONCAT(chronoDescriptor, __LINE__) = {                                       \
+      __FUNCTION__, CHRONO_FUNCTION_SIGNATURE, __FILE__, __LINE__};                                                     \
+  static const std::uint32_t CHRONO_CONCAT(chronoSite, __LINE__) =                                                      \
+      SiteRegistry::getInstance().registerSite(CHRONO_CONCAT(chronoDescriptor, __LINE__));                             \
+  Timer CHRONO_CONCAT(timer, __LINE__)(CHRONO_CONCAT(chronoSite, __LINE__), Profiler::current())
+
+/// @brief Times the enclosing scope like RECORD_CALL() and reports it when it runs longer than
+/// budgetUs microseconds, see Profiler::setBudgetCallback()
+#define RECORD_CALL_BUDGET(budgetUs)                                                                                    \
+  static constexpr SiteDescriptor CHRONO_CONCAT(chronoDescriptor, __LINE__) = {                                       \
+      __FUNCTION__, CHRONO_FUNCTION_SIGNATURE, __FILE__, __LINE__};                                                     \
+  static const std::uint32_t CHRONO_CONCAT(chronoSite, __LINE__) =                                                      \
+      SiteRegistry::getInstance().registerSite(CHRONO_CONCAT(chronoDescriptor, __LINE__));                             \
+  Timer CHRONO_CONCAT(timer, __LINE__)(CHRONO_CONCAT(chronoSite, __LINE__), Profiler::current(),                        \
+                                       std::chrono::microseconds(budgetUs))
+
+/// @brief Times the enclosing scope under a name built at runtime, such as a script function or a
+/// query fingerprint. All scopes with the same name share one site
+#define RECORD_SCOPE_DYNAMIC(name)                                                                                      \
+  Timer CHRONO_CONCAT(timer, __LINE__)(Profiler::current().dynamicSite(name), Profiler::current())
+
+/// @brief Times the enclosing scope like RECORD_CALL() and splits the site's totals by label, a string
+/// known at runtime such as an endpoint. The number of labels tracked per site is bounded, see
+/// Profiler::setLabelLimits()
+#define RECORD_CALL_LABEL(label)                                                                                        \
+  static constexpr SiteDescriptor CHRONO_CONCAT(chronoDescriptor, __LINE__) = {                                       \
+      __FUNCTION__, CHRONO_FUNCTION_SIGNATURE, __FILE__, __LINE__};                                                     \
+  static const std::uint32_t CHRONO_CONCAT(chronoSite, __LINE__) =                                                      \
+      SiteRegistry::getInstance().registerSite(CHRONO_CONCAT(chronoDescriptor, __LINE__));                             \
+  Timer CHRONO_CONCAT(timer, __LINE__)(CHRONO_CONCAT(chronoSite, __LINE__), Profiler::current(), label)
+
+/// @brief Annotates the innermost open scope with key=value, key must be a string literal. Values
+/// are integers, floating point numbers, bools or strings, stored inline without allocating
+#define CHRONO_TAG(key, value)                                                                                          \
+  do                                                                                                                    \
+  {                                                                                                                     \
+    static const std::uint32_t chronoTagKey = SiteRegistry::getInstance().intern(key);                                  \
+    Profiler::current().tag(chronoTagKey, value);                                                                       \
+  } while (0)
+
+/// @brief Adds delta to the counter name, name must be a string literal
+#define CHRONO_COUNT(name, delta)                                                                                       \
+  do                                                                                                                    \
+  {                                                                                                                     \
+    static const std::uint32_t chronoMetric =                                                                           \
+        SiteRegistry::getInstance().registerMetric(name, MetricKind::Counter, __FILE__, __LINE__);                      \
+    Profiler::current().recordMetric(chronoMetric, MetricKind::Counter, static_cast<double>(delta));                    \
+  } while (0)
+
+/// @brief Sets the gauge name, the report shows the value set last on any thread
+#define CHRONO_GAUGE(name, value)                                                                                       \
+  do                                                                                                                    \
+  {                                                                                                                     \
+    static const std::uint32_t chronoMetric =                                                                           \
+        SiteRegistry::getInstance().registerMetric(name, MetricKind::Gauge, __FILE__, __LINE__);                        \
+    Profiler::current().recordMetric(chronoMetric, MetricKind::Gauge, static_cast<double>(value));                      \
+  } while (0)
+
+/// @brief Adds a sample to the distribution name, e.g. a batch size
+#define CHRONO_VALUE(name, sample)                                                                                      \
+  do                                                                                                                    \
+  {                                                                                                                     \
+    static const std::uint32_t chronoMetric =                                                                           \
+        SiteRegistry::getInstance().registerMetric(name, MetricKind::Value, __FILE__, __LINE__);                        \
+    Profiler::current().recordMetric(chronoMetric, MetricKind::Value, static_cast<double>(sample));                     \
+  } while (0)
+
+/// @brief Records the time since the enclosing scope's previous checkpoint (or its start) as the
+/// phase "function/name", the rest of the scope after the last checkpoint stays its own time
+#define RECORD_CHECKPOINT(name)                                                                                         \
+  static constexpr SiteDescriptor CHRONO_CONCAT(chronoCheckpoint, __LINE__) = {                                       \
+      __FUNCTION__, CHRONO_FUNCTION_SIGNATURE, __FILE__, __LINE__};                                                     \
+  static const std::uint32_t CHRONO_CONCAT(chronoSite, __LINE__) =                                                      \
+      SiteRegistry::getInstance().registerCheckpoint(CHRONO_CONCAT(chronoCheckpoint, __LINE__), name);                 \
+  Profiler::current().checkpoint(CHRONO_CONCAT(chronoSite, __LINE__))
+
+/// @brief Declares the loop timer used by RECORD_ITERATION(), place it right before the loop
+#define RECORD_LOOP()                                                                                                   \
+  static constexpr SiteDescriptor CHRONO_CONCAT(chronoLoopDescriptor, __LINE__) = {                                   \
+      __FUNCTION__, CHRONO_FUNCTION_SIGNATURE, __FILE__, __LINE__};                                                     \
+  static const std::uint32_t CHRONO_CONCAT(chronoSite, __LINE__) =                                                      \
+      SiteRegistry::getInstance().registerLoop(CHRONO_CONCAT(chronoLoopDescriptor, __LINE__));                         \
+  LoopTimer CHRONO_CONCAT(chronoLoop, __LINE__)(CHRONO_CONCAT(chronoSite, __LINE__), Profiler::current())
+
+/// @brief Times one iteration of the innermost RECORD_LOOP(), place it first in the loop body.
+/// Loops may follow each other or nest, the iteration belongs to the last RECORD_LOOP() still in scope
+#define RECORD_ITERATION() LoopIteration CHRONO_CONCAT(chronoIteration, __LINE__)(LoopTimer::innermost())
+
+/// @brief Times the enclosing scope as the root span of a new trace, name must be a string literal
+#define RECORD_REQUEST(name)                                                                                            \
+  static const std::uint32_t CHRONO_CONCAT(chronoSite, __LINE__) =                                                      \
+      SiteRegistry::getInstance().registerSite(name, __FILE__, __LINE__);                                              \
+  Timer CHRONO_CONCAT(timer, __LINE__)(CHRONO_CONCAT(chronoSite, __LINE__), Profiler::current(), true)
 #else
 #define RECORD_CALL()
+#define RECORD_CALL_BUDGET(budgetUs)
+#define RECORD_CALL_LABEL(label)
+#define RECORD_SCOPE_DYNAMIC(name)
+#define RECORD_CHECKPOINT(name)
+#define RECORD_LOOP()
+#define RECORD_ITERATION()
+#define CHRONO_TAG(key, value)
+#define CHRONO_COUNT(name, delta)
+#define CHRONO_GAUGE(name, value)
+#define CHRONO_VALUE(name, sample)
+#define RECORD_REQUEST(name)
+#endif
+
+/// @brief Define CHRONOSCOPE_INSTRUMENT_FUNCTIONS in exactly one translation unit to get the hooks called by
+/// code built with -finstrument-functions. Building with -finstrument-functions-exclude-file-list=chronoscope.h
+/// (GCC) keeps the profiler itself out of the profile. Without it, as with Clang, the profiler's inline
+/// functions are profiled too; hooks that run under a profiler lock are skipped and their frames are
+/// matched by address in functionExit, so they cannot unbalance the scope stack. The hooks stop
+/// once static destruction reaches the profiler singletons
+#if defined(CHRONOSCOPE_INSTRUMENT_FUNCTIONS) && defined(CHRONOSCOPE_SYMBOLS)
+/// @brief Set while a hook runs, so functions called by the hook itself are not profiled
+static thread_local bool chronoInHook = false;
+
+extern "C"
+{
+  __attribute__((no_instrument_function)) void __cyg_profile_func_enter(void *function, void *)
+  {
+    if (chronoInHook)
+    {
+      return;
+    }
+    chronoInHook = true;
+    if (!ProfilerLock::busyDepth() && !ProfilerShutdown::started().load(std::memory_order_relaxed))
+    {
+      Profiler::getInstance().functionEnter(function);
+    }
+    chronoInHook = false;
+  }
+
+  __attribute__((no_instrument_function)) void __cyg_profile_func_exit(void *function, void *)
+  {
+    if (chronoInHook)
+    {
+      return;
+    }
+    chronoInHook = true;
+    if (!ProfilerLock::busyDepth() && !ProfilerShutdown::started().load(std::memory_order_relaxed))
+    {
+      Profiler::getInstance().functionExit(function);
+    }
+    chronoInHook = false;
+  }
+}
 #endif
@@ -0,0 +1,109 @@
+#define CHRONOSCOPE_INSTRUMENT_FUNCTIONS
+#include "chronoscope.h"
+
+#include <cstdio>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Built with -finstrument-functions and no exclude list, so the profiler, the standard library
+// and the destructors of these statics all call the hooks, up to the end of the process
+
+static std::unordered_map<int, std::string> names;
+static std::map<std::string, int> ids;
+
+namespace app
+{
+struct Worker
+{
+  int run(int steps)
+  {
+    int sum = 0;
+    for (int i = 0; i < steps; ++i)
+    {
+      sum += step(i);
+    }
+    return sum;
+  }
+
+  int step(int i)
+  {
+    return i % 7;
+  }
+};
+} // namespace app
+
+/// @brief Totals of the first group whose name contains the given name
+static ProfileInfo totals(const std::string &name, RollupLevel level = RollupLevel::Site)
+{
+  for (const auto &entry : Profiler::getInstance().rollup(level))
+  {
+    if (entry.first.find(name) != std::string::npos)
+    {
+      return entry.second;
+    }
+  }
+  return ProfileInfo();
+}
+
+static unsigned long long calls(const std::string &name)
+{
+  return totals(name).count;
+}
+
+int main()
+{
+  for (int i = 0; i < 100; ++i)
+  {
+    names[i] = std::to_string(i);
+    ids[names[i]] = i;
+  }
+
+  app::Worker worker;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; ++t)
+  {
+    threads.emplace_back(
+        [&worker]()
+        {
+          for (int i = 0; i < 10; ++i)
+          {
+            worker.run(5);
+          }
+        });
+  }
+  for (std::thread &thread : threads)
+  {
+    thread.join();
+  }
+  int total = 0;
+  for (int i = 0; i < 100; ++i)
+  {
+    total += worker.run(10);
+  }
+
+  int failures = 0;
+  if (total != 2400)
+  {
+    std::fprintf(stderr, "total is %d, expected 2400\n", total);
+    failures++;
+  }
+  if (calls("app::Worker::run(int)") != 140 || calls("app::Worker::step(int)") != 1200)
+  {
+    std::fprintf(stderr, "run has %llu calls, step %llu, expected 140 and 1200\n", calls("app::Worker::run(int)"),
+                 calls("app::Worker::step(int)"));
+    failures++;
+  }
+  // step() always runs inside run(), so the class spent exactly the inclusive time of run()
+  long long classDuration = totals("app::Worker", RollupLevel::Class).duration;
+  long long runDuration = totals("app::Worker::run(int)").duration;
+  if (classDuration != runDuration)
+  {
+    std::fprintf(stderr, "app::Worker took %lld ns, expected the %lld ns of run()\n", classDuration, runDuration);
+    failures++;
+  }
+  Profiler::getInstance().dumpTextReport("hooks_report.txt");
+  std::printf("%s hooks\n", failures ? "FAIL" : "PASS");
+  return failures ? 1 : 0;
+}
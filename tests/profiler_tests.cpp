@@ -0,0 +1,503 @@
+#include "chronoscope.h"
+
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using TestProfiler = BasicProfiler<ManualClockPolicy>;
+using TestTimer = BasicTimer<TestProfiler>;
+
+/// @brief ManualClockPolicy with a latency histogram per site
+struct ManualHistogramPolicy : ManualClockPolicy
+{
+  static constexpr StatisticsMode kStatistics = StatisticsMode::Histogram;
+};
+
+using HistogramProfiler = BasicProfiler<ManualHistogramPolicy>;
+
+static int failures = 0;
+
+#define CHECK(condition)                                                                                                \
+  do                                                                                                                    \
+  {                                                                                                                     \
+    if (!(condition))                                                                                                   \
+    {                                                                                                                   \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);                               \
+      failures++;                                                                                                       \
+    }                                                                                                                   \
+  } while (false)
+
+#define CHECK_EQ(actual, expected)                                                                                      \
+  do                                                                                                                    \
+  {                                                                                                                     \
+    long long actualValue = static_cast<long long>(actual);                                                             \
+    long long expectedValue = static_cast<long long>(expected);                                                         \
+    if (actualValue != expectedValue)                                                                                   \
+    {                                                                                                                   \
+      std::fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, actualValue,              \
+                   expectedValue);                                                                                      \
+      failures++;                                                                                                       \
+    }                                                                                                                   \
+  } while (false)
+
+static long long us(long long microseconds)
+{
+  return microseconds * 1000;
+}
+
+static void advance(long long microseconds)
+{
+  ManualClock::advance(std::chrono::microseconds(microseconds));
+}
+
+/// @brief A site registered once per test, so the tests do not share statistics
+static std::uint32_t site(const char *name)
+{
+  return SiteRegistry::getInstance().registerSite(name, "profiler_tests.cpp", 1);
+}
+
+/// @brief Totals of the site in a rollup, zeros when it has no calls
+static ProfileInfo find(const std::vector<std::pair<std::string, ProfileInfo>> &entries, std::uint32_t id)
+{
+  std::string name = SiteRegistry::groupName(SiteRegistry::getInstance().site(id), RollupLevel::Site);
+  for (const auto &entry : entries)
+  {
+    if (entry.first == name)
+    {
+      return entry.second;
+    }
+  }
+  return ProfileInfo();
+}
+
+template <typename ProfilerType>
+static ProfileInfo stats(const ProfilerType &profiler, std::uint32_t id)
+{
+  return find(profiler.rollup(), id);
+}
+
+static void testNesting()
+{
+  TestProfiler profiler;
+  std::uint32_t outer = site("nesting_outer");
+  std::uint32_t inner = site("nesting_inner");
+  for (int i = 0; i < 3; ++i)
+  {
+    TestTimer outerTimer(outer, profiler);
+    advance(10);
+    {
+      TestTimer innerTimer(inner, profiler);
+      advance(5);
+    }
+    advance(1);
+  }
+
+  ProfileInfo outerInfo = stats(profiler, outer);
+  CHECK_EQ(outerInfo.count, 3);
+  CHECK_EQ(outerInfo.duration, us(48));
+  CHECK_EQ(outerInfo.selfDuration, us(33));
+  CHECK_EQ(outerInfo.maxDepth, 1);
+  ProfileInfo innerInfo = stats(profiler, inner);
+  CHECK_EQ(innerInfo.count, 3);
+  CHECK_EQ(innerInfo.duration, us(15));
+  CHECK_EQ(innerInfo.selfDuration, us(15));
+}
+
+static void recurse(TestProfiler &profiler, std::uint32_t id, int depth)
+{
+  TestTimer timer(id, profiler);
+  advance(2);
+  if (depth > 1)
+  {
+    recurse(profiler, id, depth - 1);
+  }
+}
+
+static void testRecursion()
+{
+  TestProfiler profiler;
+  std::uint32_t id = site("recursion");
+  recurse(profiler, id, 4);
+
+  // Only the outermost activation adds to the inclusive time, every level keeps its own self time
+  ProfileInfo info = stats(profiler, id);
+  CHECK_EQ(info.count, 4);
+  CHECK_EQ(info.duration, us(8));
+  CHECK_EQ(info.selfDuration, us(8));
+  CHECK_EQ(info.recursiveCount, 3);
+  CHECK_EQ(info.maxDepth, 4);
+}
+
+static void testThreads()
+{
+  TestProfiler profiler;
+  std::uint32_t id = site("threads");
+  const int kThreads = 4;
+  std::mutex mtx;
+  std::condition_variable cv;
+  int open = 0;
+  bool advanced = false;
+
+  // Every thread holds its scope open while the clock moves once, so each call takes exactly 10 us
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i)
+  {
+    threads.emplace_back(
+        [&]()
+        {
+          TestTimer timer(id, profiler);
+          std::unique_lock<std::mutex> lock(mtx);
+          open++;
+          cv.notify_all();
+          cv.wait(lock, [&]() { return advanced; });
+        });
+  }
+  {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&]() { return open == kThreads; });
+    advance(10);
+    advanced = true;
+    cv.notify_all();
+  }
+  for (std::thread &thread : threads)
+  {
+    thread.join();
+  }
+
+  ProfileInfo info = stats(profiler, id);
+  CHECK_EQ(info.count, kThreads);
+  CHECK_EQ(info.duration, us(10 * kThreads));
+  CHECK_EQ(info.selfDuration, us(10 * kThreads));
+  CHECK_EQ(info.recursiveCount, 0);
+}
+
+static void testThreadChurn()
+{
+  TestProfiler profiler;
+  std::uint32_t id = site("churn");
+  for (int i = 0; i < 50; ++i)
+  {
+    std::thread thread(
+        [&]()
+        {
+          TestTimer timer(id, profiler);
+          advance(1);
+        });
+    thread.join();
+  }
+
+  // Every thread reuses the state the previous one left, with the totals recorded in it
+  CHECK_EQ(profiler.threadCount(), 1);
+  CHECK_EQ(stats(profiler, id).count, 50);
+  CHECK_EQ(stats(profiler, id).duration, us(50));
+}
+
+static void testSnapshotAndReset()
+{
+  TestProfiler profiler;
+  std::uint32_t id = site("snapshot");
+  {
+    TestTimer timer(id, profiler);
+    advance(3);
+  }
+
+  // A rollup is a copy, later calls do not change it
+  std::vector<std::pair<std::string, ProfileInfo>> snapshot = profiler.rollup();
+  {
+    TestTimer timer(id, profiler);
+    advance(4);
+  }
+  CHECK_EQ(find(snapshot, id).count, 1);
+  CHECK_EQ(find(snapshot, id).duration, us(3));
+  CHECK_EQ(stats(profiler, id).count, 2);
+  CHECK_EQ(stats(profiler, id).duration, us(7));
+
+  // A fresh instance starts from zero and merge() adds the totals of another one
+  TestProfiler fresh;
+  CHECK_EQ(stats(fresh, id).count, 0);
+  fresh.merge(profiler);
+  fresh.merge(profiler);
+  CHECK_EQ(stats(fresh, id).count, 4);
+  CHECK_EQ(stats(fresh, id).duration, us(14));
+
+  // Setting the clock back between scopes leaves the recorded durations exact
+  ManualClock::set(std::chrono::nanoseconds(0));
+  {
+    TestTimer timer(id, fresh);
+    advance(1);
+  }
+  CHECK_EQ(stats(fresh, id).count, 5);
+  CHECK_EQ(stats(fresh, id).duration, us(15));
+
+  // reset() clears the totals, labels and tags, later calls count from zero
+  std::uint32_t key = SiteRegistry::getInstance().intern("snapshot_key");
+  {
+    TestTimer timer(id, fresh, "label");
+    fresh.tag(key, 1);
+    advance(2);
+  }
+  CHECK_EQ(fresh.labelStats(id).size(), 1);
+  CHECK_EQ(fresh.rollupByTag("snapshot_key").size(), 1);
+  fresh.reset();
+  CHECK(fresh.rollup().empty());
+  CHECK(fresh.labelStats(id).empty());
+  CHECK(fresh.rollupByTag("snapshot_key").empty());
+  {
+    TestTimer timer(id, fresh);
+    advance(5);
+  }
+  CHECK_EQ(stats(fresh, id).count, 1);
+  CHECK_EQ(stats(fresh, id).duration, us(5));
+  CHECK_EQ(stats(profiler, id).count, 2);
+}
+
+/// @brief Lines of the file, without the ones starting with skipped
+static std::string readLines(const char *filename, const std::string &skipped)
+{
+  std::ifstream file(filename);
+  std::string text;
+  for (std::string line; std::getline(file, line);)
+  {
+    if (line.compare(0, skipped.size(), skipped) != 0)
+    {
+      text += line + "\n";
+    }
+  }
+  return text;
+}
+
+static void testReports()
+{
+  TestProfiler profiler;
+  SiteRegistry &registry = SiteRegistry::getInstance();
+  std::uint32_t run = registry.registerSite("void golden::Worker::run()", "golden.cpp", 10);
+  std::uint32_t step = registry.registerSite("int golden::Worker::step(int)", "golden.cpp", 20);
+  std::uint32_t helper = registry.registerSite("void goldenutil::helper()", "golden.cpp", 30);
+  {
+    TestTimer runTimer(run, profiler);
+    advance(2);
+    for (int i = 0; i < 2; ++i)
+    {
+      TestTimer stepTimer(step, profiler);
+      advance(3);
+      TestTimer helperTimer(helper, profiler);
+      advance(1);
+    }
+  }
+
+  // The clock line measures the cost of a reading, the rest of the report is exact
+  const char *filename = "profiler_tests_report.txt";
+  profiler.dumpTextReport(filename);
+  CHECK(readLines(filename, "Clock:") == "===== Profiling Report =====\n"
+                                         "golden.cpp:10:golden::Worker::run(): 10 us, 2 us self, 1 calls\n"
+                                         "golden.cpp:20:golden::Worker::step(int): 8 us, 6 us self, 2 calls\n"
+                                         "golden.cpp:30:goldenutil::helper(): 2 us, 2 us self, 2 calls\n");
+  std::remove(filename);
+
+  std::string namespaces;
+  for (const auto &entry : profiler.rollup(RollupLevel::Namespace))
+  {
+    namespaces += entry.first + " " + std::to_string(entry.second.count) + " " +
+                  std::to_string(entry.second.duration / 1000) + " " +
+                  std::to_string(entry.second.selfDuration / 1000) + "\n";
+  }
+  CHECK(namespaces == "golden 3 10 8\n"
+                      "goldenutil 2 2 2\n");
+}
+
+static void testOverflow()
+{
+  TestProfiler profiler;
+  std::uint32_t deep = site("overflow_deep");
+  std::uint32_t past = site("overflow_past");
+  std::vector<std::unique_ptr<TestTimer>> timers;
+  for (std::uint32_t i = 0; i < ThreadState::kMaxScopeDepth; ++i)
+  {
+    timers.emplace_back(new TestTimer(deep, profiler));
+  }
+  {
+    // Past the stack limit a scope only counts as a call, its time stays with the deepest tracked scope
+    TestTimer timer(past, profiler);
+    advance(3);
+  }
+  while (!timers.empty())
+  {
+    timers.pop_back();
+  }
+
+  ProfileInfo pastInfo = stats(profiler, past);
+  CHECK_EQ(pastInfo.count, 1);
+  CHECK_EQ(pastInfo.duration, 0);
+  ProfileInfo deepInfo = stats(profiler, deep);
+  CHECK_EQ(deepInfo.count, ThreadState::kMaxScopeDepth);
+  CHECK_EQ(deepInfo.duration, us(3));
+  CHECK_EQ(deepInfo.selfDuration, us(3));
+  CHECK_EQ(deepInfo.maxDepth, ThreadState::kMaxScopeDepth);
+
+  // Labels past the exact slots fall into the overflow bucket
+  std::uint32_t labelled = site("overflow_labels");
+  profiler.setLabelLimits(1, 0);
+  const char *labels[] = {"a", "b", "a", "c"};
+  for (const char *label : labels)
+  {
+    TestTimer timer(labelled, profiler, label);
+    advance(2);
+  }
+  std::vector<LabelStats> labelStats = profiler.labelStats(labelled);
+  CHECK_EQ(labelStats.size(), 2);
+  if (labelStats.size() == 2)
+  {
+    CHECK(labelStats[0].label == "a" && labelStats[0].exact && !labelStats[0].overflow);
+    CHECK_EQ(labelStats[0].info.count, 2);
+    CHECK_EQ(labelStats[0].info.duration, us(4));
+    CHECK(labelStats[1].overflow);
+    CHECK_EQ(labelStats[1].info.count, 2);
+    CHECK_EQ(labelStats[1].info.duration, us(4));
+  }
+
+  // So do tag values past the limit, in one group per site and key
+  std::uint32_t tagged = site("overflow_tags");
+  std::uint32_t key = SiteRegistry::getInstance().intern("overflow_key");
+  profiler.setTagValueLimit(2);
+  const int values[] = {1, 2, 1, 3, 4};
+  for (int value : values)
+  {
+    TestTimer timer(tagged, profiler);
+    profiler.tag(key, value);
+    advance(1);
+  }
+  std::vector<std::pair<std::string, ProfileInfo>> tagStats = profiler.rollupByTag("overflow_key");
+  CHECK_EQ(tagStats.size(), 3);
+  for (const auto &entry : tagStats)
+  {
+    bool other = entry.first.find("=(other values)]") != std::string::npos;
+    bool one = entry.first.find("=1]") != std::string::npos;
+    CHECK_EQ(entry.second.count, other || one ? 2 : 1);
+  }
+}
+
+/// @brief Occurrences of text in the file
+static int occurrences(const char *filename, const std::string &text)
+{
+  std::ifstream file(filename);
+  std::stringstream contents;
+  contents << file.rdbuf();
+  int count = 0;
+  for (std::size_t at = contents.str().find(text); at != std::string::npos; at = contents.str().find(text, at + 1))
+  {
+    count++;
+  }
+  return count;
+}
+
+static void testTraceRing()
+{
+  TestProfiler profiler;
+  std::uint32_t outer = site("ring_outer");
+  std::uint32_t first = site("ring_first");
+  std::uint32_t second = site("ring_second");
+  profiler.setTraceCapacity(4);
+  {
+    TestTimer outerTimer(outer, profiler);
+    {
+      TestTimer timer(first, profiler);
+      advance(1);
+    }
+    {
+      TestTimer timer(second, profiler);
+      advance(1);
+    }
+  }
+
+  // The ring keeps the last four of the six events. The closes of the first and outer scopes lost
+  // their opens and are left out, the second scope is exported whole
+  const char *filename = "profiler_tests_trace.json";
+  profiler.dumpSpeedscope(filename);
+  CHECK_EQ(occurrences(filename, "\"frame\":" + std::to_string(outer) + ","), 0);
+  CHECK_EQ(occurrences(filename, "\"frame\":" + std::to_string(first) + ","), 0);
+  CHECK_EQ(occurrences(filename, "\"frame\":" + std::to_string(second) + ","), 2);
+  std::remove(filename);
+}
+
+static void testPercentiles()
+{
+  HistogramProfiler profiler;
+  std::uint32_t id = site("percentiles");
+  for (int i = 1; i <= 1000; ++i)
+  {
+    BasicTimer<HistogramProfiler> timer(id, profiler);
+    advance(i);
+  }
+
+  // Buckets split every power of two in four, so a percentile is within 25% of the exact value
+  LatencyHistogram histogram = profiler.siteHistogram(id);
+  CHECK_EQ(histogram.count(), 1000);
+  CHECK_EQ(histogram.max(), us(1000));
+  const double fractions[] = {0.5, 0.9, 0.99};
+  for (double fraction : fractions)
+  {
+    double exact = static_cast<double>(us(static_cast<long long>(fraction * 1000)));
+    double estimate = static_cast<double>(histogram.percentile(fraction));
+    CHECK(estimate >= exact * 0.75 && estimate <= exact * 1.25);
+  }
+  CHECK_EQ(stats(profiler, id).duration, us(500500));
+}
+
+static void testSignatures()
+{
+  struct
+  {
+    const char *signature;
+    const char *displayName;
+    const char *namespaceName;
+    const char *className;
+  } cases[] = {
+      {"int app::Worker::run(int)", "app::Worker::run(int)", "app", "Worker"},
+      {"T app::Cache<T>::get() const [with T = int]", "app::Cache<T>::get() const [with T = int]", "app", "Cache<T>"},
+      {"app::lower::lower()", "app::lower::lower()", "app", "lower"},
+      {"app::lower::run(int) const::<lambda(int)>", "app::lower::run(int) const::<lambda(int)>", "app", "lower"},
+      {"app::run(int)::{lambda(int)#1}::operator()(int) const", "app::run(int)::{lambda(int)#1}(int) const", "app", ""},
+      {"void (anonymous namespace)::f(int)", "(anonymous namespace)::f(int)", "(anonymous namespace)", ""},
+  };
+  for (const auto &test : cases)
+  {
+    SiteRegistry &registry = SiteRegistry::getInstance();
+    const SiteInfo &info = registry.site(registry.registerSite("f", test.signature, "profiler_tests.cpp", 1));
+    CHECK(info.displayName == test.displayName);
+    CHECK(info.namespaceName == test.namespaceName);
+    CHECK(info.className == test.className);
+  }
+}
+
+int main()
+{
+  struct
+  {
+    const char *name;
+    void (*run)();
+  } tests[] = {
+      {"nesting", testNesting},
+      {"recursion", testRecursion},
+      {"threads", testThreads},
+      {"churn", testThreadChurn},
+      {"snapshot", testSnapshotAndReset},
+      {"reports", testReports},
+      {"overflow", testOverflow},
+      {"trace ring", testTraceRing},
+      {"percentiles", testPercentiles},
+      {"signatures", testSignatures},
+  };
+
+  for (const auto &test : tests)
+  {
+    int before = failures;
+    ManualClock::set(std::chrono::nanoseconds(0));
+    test.run();
+    std::printf("%s %s\n", failures == before ? "PASS" : "FAIL", test.name);
+  }
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,125 @@
+#include "chronoscope.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+// Many threads record while others snapshot, reset, merge, export and come and go. Meant to run under
+// ThreadSanitizer or AddressSanitizer, see CHRONOSCOPE_TSAN and CHRONOSCOPE_ASAN in CMakeLists.txt
+
+static std::atomic<bool> stopping{false};
+
+static void leaf(int i)
+{
+  RECORD_CALL();
+  CHRONO_TAG("shard", i % 3);
+  CHRONO_COUNT("calls", 1);
+  CHRONO_VALUE("index", i);
+}
+
+static void middle(int i)
+{
+  RECORD_CALL_LABEL(i % 2 ? "odd" : "even");
+  leaf(i);
+  {
+    RECORD_SCOPE_DYNAMIC(std::string("dynamic") + char('0' + i % 5));
+    leaf(i);
+  }
+}
+
+static void work()
+{
+  RECORD_LOOP();
+  for (int i = 0; i < 2000 && !stopping; ++i)
+  {
+    RECORD_ITERATION();
+    middle(i);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  int rounds = argc > 1 ? std::atoi(argv[1]) : 10;
+  Profiler &profiler = Profiler::current();
+  profiler.setFrameHistory(50);
+  profiler.setLatencyObjective("leaf", std::chrono::microseconds(100), 0.99);
+  profiler.startOtlpExport("stress_spans.jsonl");
+
+  // Recording threads are created and joined in rounds, so thread states keep being added and retired
+  std::thread churn(
+      [rounds]()
+      {
+        for (int round = 0; round < rounds; ++round)
+        {
+          std::vector<std::thread> workers;
+          for (int i = 0; i < 4; ++i)
+          {
+            workers.emplace_back(work);
+          }
+          for (std::thread &worker : workers)
+          {
+            worker.join();
+          }
+        }
+      });
+  std::thread frames(
+      [&profiler]()
+      {
+        while (!stopping)
+        {
+          profiler.beginFrame();
+          std::this_thread::sleep_for(std::chrono::microseconds(200));
+          profiler.endFrame();
+        }
+      });
+  std::thread snapshots(
+      [&profiler]()
+      {
+        while (!stopping)
+        {
+          profiler.dumpTextReport("stress_report.txt");
+          profiler.dumpFrameReport("stress_frames.txt");
+          profiler.dumpSpeedscope("stress_trace.json");
+          profiler.dumpObjectiveReport("stress_objectives.txt");
+          profiler.dumpTagReport("stress_tags.txt", "shard");
+          profiler.rollup(RollupLevel::Class);
+          profiler.metrics();
+          profiler.recentFrames();
+          profiler.objectiveStatus();
+          profiler.reset();
+        }
+      });
+  // Short-lived instances record, then merge into the global profiler and back
+  std::thread merges(
+      [&profiler]()
+      {
+        while (!stopping)
+        {
+          Profiler other;
+          {
+            ScopedProfiler scoped(other);
+            work();
+          }
+          profiler.merge(other);
+          other.merge(profiler);
+        }
+      });
+
+  churn.join();
+  stopping = true;
+  frames.join();
+  snapshots.join();
+  merges.join();
+  profiler.stopOtlpExport();
+  profiler.dumpTextReport("stress_report.txt");
+  std::printf("stress test finished after %d rounds, %zu thread states\n", rounds, profiler.threadCount());
+
+  // Exited recording threads hand their states to the next round instead of adding new ones
+  if (profiler.threadCount() > 8)
+  {
+    std::fprintf(stderr, "%zu thread states after %d rounds of 4 threads\n", profiler.threadCount(), rounds);
+    return 1;
+  }
+  return 0;
+}